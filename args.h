@@ -69,6 +69,11 @@ INLINE void args_set_fill(struct args *args, cnum fill)
 
 #define args_decl(NAME, N) args_decl_list(NAME, N, nil)
 
+#define args_decl_constsize(NAME, N)                                    \
+  mem_t *NAME ## _mem[(offsetof(struct args, arg) + (N)*sizeof (val))   \
+                      / sizeof (mem_t *)];                              \
+  struct args *NAME = args_init_list(coerce(struct args *,              \
+                                            NAME ## _mem), N, nil)
 
 INLINE val args_add(struct args *args, val arg)
 {
@@ -5496,8 +5496,7 @@ val put_obj(val obj, val type, val stream)
   cnum size = tft->size;
   val len = num(size);
   mem_t *data = coerce(mem_t *, zalloca(size));
-  obj_t buf_obj;
-  val buf = init_borrowed_buf(&buf_obj, len, data);
+  val buf = make_borrowed_buf(len, data);
   tft->put(tft, obj, data, self);
   return eql(put_buf(buf, zero, stream), len);
 }
@@ -5510,8 +5509,7 @@ val get_obj(val type, val stream)
   cnum size = tft->size;
   val len = num(size);
   mem_t *data = coerce(mem_t *, zalloca(size));
-  obj_t buf_obj;
-  val buf = init_borrowed_buf(&buf_obj, len, data);
+  val buf = make_borrowed_buf(len, data);
   if (neql(fill_buf(buf, zero, stream), len))
     return nil;
   return tft->get(tft, data, self);
@@ -5524,8 +5522,7 @@ val fill_obj(val obj, val type, val stream)
   cnum size = tft->size;
   val len = num(size);
   mem_t *data = coerce(mem_t *, zalloca(size));
-  obj_t buf_obj;
-  val buf = init_borrowed_buf(&buf_obj, len, data);
+  val buf = make_borrowed_buf(len, data);
   if (neql(fill_buf(buf, zero, stream), len))
     return nil;
   return tft->in(tft, 1, data, obj, self);
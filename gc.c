@@ -27,30 +27,75 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <stdarg.h>
 #include <assert.h>
 #include <dirent.h>
 #include <wchar.h>
 #include <signal.h>
+#include <string.h>
+#include <sys/time.h>
 #include "config.h"
+#include ALLOCA_H
+#if HAVE_MMAP
+#include <sys/mman.h>
+#endif
 #if HAVE_VALGRIND
 #include <valgrind/memcheck.h>
 #endif
+#if HAVE_PTHREADS
+#include <pthread.h>
+#endif
 #include "lib.h"
 #include "stream.h"
 #include "hash.h"
 #include "txr.h"
 #include "eval.h"
 #include "gc.h"
+#include "args.h"
+#include "struct.h"
+#include "arith.h"
 #include "signal.h"
+#include "unwind.h"
+#include "vm.h"
 
 #define PROT_STACK_SIZE         1024
-#define HEAP_SIZE               16384
+#define HEAP_BYTES              (512 * 1024)
+#define HEAP_SIZE               ((HEAP_BYTES - 64) / sizeof (obj_t))
 #define CHECKOBJ_VEC_SIZE       (2 * HEAP_SIZE)
 #define MUTOBJ_VEC_SIZE         (2 * HEAP_SIZE)
 #define FULL_GC_INTERVAL        40
-#define FRESHOBJ_VEC_SIZE       (8 * HEAP_SIZE)
+#define NURSERY_SIZE            (8 * HEAP_SIZE)
 #define DFL_MALLOC_DELTA_THRESH (64L * 1024 * 1024)
+#define MARK_PACKET_SIZE        1024
+#define MARK_STACK_KEEP         (64 * MARK_PACKET_SIZE)
+#define MARK_PREFETCH_DEPTH     8
+#define PAR_MARK_MAX_THREADS    64
+#define PAR_MARK_MIN_HEAPS      64
+#define INC_SLICE_ALLOCS        1024
+#define INC_CHECK_WORK          256
+#define GC_PAUSE_BUCKETS        24
+#define HEAP_RELEASE_SWEEPS     2
+#define HEAP_RESERVE_MIN        4
+
+#if HAVE_MMAP && (defined MAP_ANONYMOUS || defined MAP_ANON)
+#define HEAP_MMAP 1
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+#else
+#define HEAP_MMAP 0
+#endif
+
+/*
+ * Bits of the mark field of the object header. A full collection marks
+ * objects with MARK_FULL rather than the REACHABLE bit of the type field,
+ * because the marks remain in place after the collection, until the heap
+ * holding the object is lazily swept. MARK_DIRTY indicates an object noted
+ * by gc_mutated during incremental marking, for rescanning.
+ */
+#define MARK_FULL               1
+#define MARK_DIRTY              2
 
 #if __aarch64__
 #define STACK_TOP_EXTRA_WORDS 4
@@ -58,11 +103,60 @@
 #define STACK_TOP_EXTRA_WORDS 0
 #endif
 
+/*
+ * A heap occupies a region of HEAP_BYTES aligned on that size, so that
+ * the heap which holds an object is found by masking its address. The
+ * block comes first, so that the objects have the alignment of the heap,
+ * which compact conses rely on; see below.
+ */
 typedef struct heap {
-  struct heap *next;
   obj_t block[HEAP_SIZE];
+  struct heap *next;
+  mem_t *mem;
+#if CONFIG_GEN_GC
+  struct heap *young_next;
+  int unswept;
+  int young;
+#endif
+  int empty_sweeps;
+  int release;
 } heap_t;
 
+#if CONFIG_COMPACT_CONS
+
+/*
+ * Compact conses are allocated from cons heaps, which occupy aligned
+ * regions like the other heaps. The cells hold just the car and cdr;
+ * the header of the cell at index i is hdr[i]. The free list of conses
+ * is linked through the car field.
+ */
+struct cons_cell {
+  val car, cdr;
+};
+
+struct cons_hdr {
+  obj_common;
+};
+
+#define CONS_HEAP_SIZE ((HEAP_BYTES - 64) /                            \
+                        (sizeof (struct cons_cell) + sizeof (struct cons_hdr)))
+
+typedef struct cons_heap {
+  struct cons_cell block[CONS_HEAP_SIZE];
+  struct cons_hdr hdr[CONS_HEAP_SIZE];
+  struct cons_heap *next;
+  mem_t *mem;
+#if CONFIG_GEN_GC
+  struct cons_heap *young_next;
+  int unswept;
+  int young;
+#endif
+  int empty_sweeps;
+  int release;
+} cons_heap_t;
+
+#endif
+
 typedef struct mach_context {
   struct jmp buf;
 } mach_context_t;
@@ -81,14 +175,89 @@ val **gc_prot_top = prot_stack;
 
 static val free_list, *free_tail = &free_list;
 static heap_t *heap_list;
+static cnum heap_count;
 static val heap_min_bound, heap_max_bound;
 
+/*
+ * The unallocated part of the heap which was added last, from which
+ * objects are allocated by incrementing bump_next, ahead of the free list.
+ */
+static obj_t *bump_next, *bump_end;
+
+#if CONFIG_COMPACT_CONS
+static val cons_free_list;
+static struct cons_cell *cons_bump_next, *cons_bump_end;
+static cons_heap_t *cons_heap_list;
+static struct cons_cell *cons_min_bound, *cons_max_bound;
+static int_ptr_t cons_sweep_freed;
+#endif
+
+/*
+ * A heap found entirely free by HEAP_RELEASE_SWEEPS consecutive full
+ * sweeps is given back to the system, unless fewer than heap_reserve
+ * empty heaps have been kept so far in the current sweep. The reserve
+ * is a quarter of the number of heaps which the previous sweep found in
+ * use, so that a program oscillating in size doesn't keep releasing
+ * heaps only to allocate them again.
+ */
+static cnum heap_live, heap_reserve;
+static cnum sweep_live, sweep_kept, sweep_release;
+
 alloc_bytes_t gc_bytes;
 static alloc_bytes_t prev_malloc_bytes;
 alloc_bytes_t opt_gc_delta = DFL_MALLOC_DELTA_THRESH;
+int opt_gc_threads = 1;
+cnum opt_gc_pause;
+int opt_gc_log;
+static cnum gc_max_pause;
+
+/*
+ * Cumulative statistics, retrieved by gc-stats. Element i of pause_hist
+ * counts the pauses of the program lasting under 2^i microseconds, but
+ * no less than half that; the last element counts all longer pauses.
+ */
+static struct gc_stats {
+  ucnum minor, full, steps, grows, releases, freed;
+  ucnum mark_usec, sweep_usec, pause_usec, pauses;
+  ucnum pause_hist[GC_PAUSE_BUCKETS];
+} gc_stats;
+
+/*
+ * Record of a collection, written out by --gc-log. That of a full
+ * collection is completed by lazy sweeping.
+ */
+struct gc_log_rec {
+  ucnum serial;
+  const char *kind;
+  cnum mark_usec, sweep_usec, pause_usec;
+  ucnum freed;
+};
+
+static val gc_stats_s, minor_gcs_s, full_gcs_s, inc_steps_s, mark_time_s;
+static val sweep_time_s, freed_s, heaps_s, heap_grows_s, heap_releases_s;
+static val gc_bytes_s;
+static val malloc_bytes_s, pauses_s, pause_time_s, max_pause_s;
+static val pause_hist_s;
+
+/*
+ * Allocation sampling: every alloc_sample_interval allocations, make_obj
+ * attributes one to the innermost named block, which is usually that of
+ * the function being executed, or to the compiled function being executed
+ * if it was entered after that block was established. The counts are kept
+ * in an open addressing table keyed on the block name or function.
+ */
+static cnum alloc_sample_interval, alloc_sample_countdown;
+
+static struct alloc_site {
+  val site;
+  ucnum samples;
+} *alloc_sites;
+
+static cnum alloc_sites_size, alloc_sites_fill;
 
 int gc_enabled = 1;
 static int inprogress;
+ucnum gc_serial;
 
 static struct fin_reg {
   struct fin_reg *next;
@@ -102,9 +271,31 @@ static val checkobj[CHECKOBJ_VEC_SIZE];
 static int checkobj_idx;
 static val mutobj[MUTOBJ_VEC_SIZE];
 static int mutobj_idx;
-static val freshobj[FRESHOBJ_VEC_SIZE];
-static int freshobj_idx;
+static heap_t *young_list, *young_last;
+#if CONFIG_COMPACT_CONS
+static cons_heap_t *cons_young_list, *cons_young_last;
+#endif
+static cnum young_count;
 int full_gc;
+static int inc_marking, inc_countdown;
+static cnum inc_grow;
+static heap_t *sweep_next;
+static int_ptr_t sweep_freed;
+static int sweep_grow;
+#if CONFIG_COMPACT_CONS
+static cons_heap_t *cons_sweep_next;
+static int cons_sweep_grow;
+#endif
+static cnum inc_mark_usec;
+static struct gc_log_rec sweep_log;
+static void gc_auto(void);
+static void inc_step(void);
+static void sweep_lazy(void);
+#if CONFIG_COMPACT_CONS
+static void sweep_lazy_conses(void);
+#endif
+static void sweep_finish(void);
+static void gc_collect(struct timeval *start);
 #endif
 
 #if CONFIG_EXTRA_DEBUGGING
@@ -133,36 +324,133 @@ void protect(val *first, ...)
   va_end (vl);
 }
 
+/*
+ * Allocate a region of HEAP_BYTES, aligned on that size. The underlying
+ * allocation, which is to be passed to region_free, is stored in *pmem.
+ */
+static mem_t *region_alloc(mem_t **pmem)
+{
+  uint_ptr_t align = HEAP_BYTES, addr, start;
+#if HEAP_MMAP
+  size_t size = 2 * HEAP_BYTES;
+  void *mem = mmap(0, size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  assert (!async_sig_enabled);
+  if (mem == MAP_FAILED)
+    uw_throwf(alloc_error_s, lit("out of memory"), nao);
+  addr = coerce(uint_ptr_t, mem);
+  start = (addr + align - 1) & ~(align - 1);
+  /* Trim the mapping down to the aligned region. */
+  if (start > addr)
+    munmap(mem, start - addr);
+  if (start + align < addr + size)
+    munmap(coerce(void *, start + align), addr + size - (start + align));
+  *pmem = coerce(mem_t *, start);
+#else
+  mem_t *mem = chk_malloc_gc_more(HEAP_BYTES + align - 1);
+  addr = coerce(uint_ptr_t, mem);
+  start = (addr + align - 1) & ~(align - 1);
+  *pmem = mem;
+#endif
+  return coerce(mem_t *, start);
+}
+
+static void region_free(mem_t *region, mem_t *mem)
+{
+#if HEAP_MMAP
+  (void) mem;
+  munmap(region, HEAP_BYTES);
+#else
+  (void) region;
+  free(mem);
+#endif
+}
+
+static heap_t *heap_alloc(void)
+{
+  mem_t *mem;
+  heap_t *heap = coerce(heap_t *, region_alloc(&mem));
+  heap->mem = mem;
+  return heap;
+}
+
+static void heap_free(heap_t *heap)
+{
+  region_free(coerce(mem_t *, heap), heap->mem);
+}
+
+#if CONFIG_GEN_GC
+
+static heap_t *heap_of(val obj)
+{
+  uint_ptr_t addr = coerce(uint_ptr_t, obj);
+  return coerce(heap_t *, addr & ~convert(uint_ptr_t, HEAP_BYTES - 1));
+}
+
+#endif
+
+static void free_add(obj_t *block);
+
+/*
+ * Put the unallocated part of the bump region on the free list.
+ */
+static void bump_retire(void)
+{
+  while (bump_next < bump_end)
+    free_add(bump_next++);
+}
+
 static void more(void)
 {
-  heap_t *heap = coerce(heap_t *, chk_malloc_gc_more(sizeof *heap));
+  heap_t *heap = heap_alloc();
   obj_t *block = heap->block, *end = heap->block + HEAP_SIZE;
 
-  if (free_list == 0)
-    free_tail = &heap->block[0].t.next;
+#if CONFIG_IMM_FLOAT
+  assert ((coerce(uint_ptr_t, block) & FLO_IMM_TAG) == 0);
+#endif
+#if CONFIG_COMPACT_CONS
+  assert (offsetof(struct cons, car) == CONS_BIAS);
+  assert (sizeof (obj_t) % (2 * CONS_BIAS) == 0);
+  assert ((coerce(uint_ptr_t, block) & CONS_BIAS) == 0);
+#endif
+
+  bump_retire();
 
   if (end > heap_max_bound)
     heap_max_bound = end;
 
-  if (block < heap_min_bound)
+  if (heap_min_bound == 0 || block < heap_min_bound)
     heap_min_bound = block;
 
-  while (block < end) {
-    block->t.next = free_list;
+  for (; block < end; block++) {
     block->t.type = convert(type_t, FREE);
+#if CONFIG_GEN_GC
+    block->t.gen = 0;
+    block->t.mark = 0;
+#endif
 #if CONFIG_EXTRA_DEBUGGING
       if (block == break_obj) {
 #if HAVE_VALGRIND
-        VALGRIND_PRINTF_BACKTRACE("object %p newly added to free list\n", convert(void *, block));
+        VALGRIND_PRINTF_BACKTRACE("object %p newly added to bump region\n", convert(void *, block));
 #endif
         breakpt();
       }
 #endif
-    free_list = block++;
   }
 
+  bump_next = heap->block;
+  bump_end = end;
+
   heap->next = heap_list;
+#if CONFIG_GEN_GC
+  heap->unswept = 0;
+  heap->young = 0;
+#endif
+  heap->empty_sweeps = 0;
+  heap->release = 0;
   heap_list = heap;
+  heap_count++;
+  gc_stats.grows++;
 
 #if HAVE_VALGRIND
   if (opt_vg_debug)
@@ -170,31 +458,296 @@ static void more(void)
 #endif
 }
 
-val make_obj(void)
+#if CONFIG_COMPACT_CONS
+
+static cons_heap_t *cons_heap_of(val cons)
+{
+  uint_ptr_t addr = coerce(uint_ptr_t, cons) + CONS_BIAS;
+  return coerce(cons_heap_t *, addr & ~convert(uint_ptr_t, HEAP_BYTES - 1));
+}
+
+static struct cons_cell *cons_cell_of(val cons)
+{
+  return coerce(struct cons_cell *, coerce(char *, cons) + CONS_BIAS);
+}
+
+static val cons_of_cell(struct cons_cell *cell)
+{
+  return coerce(val, coerce(char *, cell) - CONS_BIAS);
+}
+
+static val cons_header(cons_heap_t *heap, struct cons_cell *cell)
+{
+  return coerce(val, &heap->hdr[cell - heap->block]);
+}
+
+#endif
+
+/*
+ * The header of an object: of a compact cons, this is found in its heap;
+ * any other object begins with its header. Only the obj_common fields
+ * may be accessed through the returned pointer.
+ */
+static val header(val obj)
+{
+#if CONFIG_COMPACT_CONS
+  if (is_compact_cons(obj))
+    return cons_header(cons_heap_of(obj), cons_cell_of(obj));
+#endif
+  return obj;
+}
+
+#if CONFIG_COMPACT_CONS
+
+static cons_heap_t *cons_heap_alloc(void)
+{
+  mem_t *mem;
+  cons_heap_t *heap = coerce(cons_heap_t *, region_alloc(&mem));
+  heap->mem = mem;
+  return heap;
+}
+
+static void cons_heap_free(cons_heap_t *heap)
+{
+  region_free(coerce(mem_t *, heap), heap->mem);
+}
+
+static void cons_bump_retire(void)
+{
+  while (cons_bump_next < cons_bump_end)
+    free_add(cons_of_cell(cons_bump_next++));
+}
+
+static void more_conses(void)
+{
+  cons_heap_t *heap = cons_heap_alloc();
+  struct cons_cell *block = heap->block, *end = heap->block + CONS_HEAP_SIZE;
+  struct cons_cell *cell;
+
+  cons_bump_retire();
+
+  if (end > cons_max_bound)
+    cons_max_bound = end;
+
+  if (cons_min_bound == 0 || block < cons_min_bound)
+    cons_min_bound = block;
+
+  for (cell = block; cell < end; cell++) {
+    val hdr = cons_header(heap, cell);
+    hdr->t.type = convert(type_t, FREE);
+#if CONFIG_GEN_GC
+    hdr->t.gen = 0;
+    hdr->t.mark = 0;
+#endif
+  }
+
+  cons_bump_next = block;
+  cons_bump_end = end;
+
+  heap->next = cons_heap_list;
+#if CONFIG_GEN_GC
+  heap->unswept = 0;
+  heap->young = 0;
+#endif
+  heap->empty_sweeps = 0;
+  heap->release = 0;
+  cons_heap_list = heap;
+  heap_count++;
+  gc_stats.grows++;
+}
+
+#endif
+
+static void alloc_site_add(val site, ucnum samples)
+{
+  cnum mask = alloc_sites_size - 1;
+  cnum i = (coerce(uint_ptr_t, site) >> 4) & mask;
+
+  while (alloc_sites[i].samples != 0 && alloc_sites[i].site != site)
+    i = (i + 1) & mask;
+
+  if (alloc_sites[i].samples == 0) {
+    alloc_sites[i].site = site;
+    alloc_sites_fill++;
+  }
+
+  alloc_sites[i].samples += samples;
+}
+
+static void alloc_sample(void)
+{
+  uw_frame_t *bottom = 0;
+  val fun = vm_current_fun(&bottom);
+  val site = uw_current_block_name(bottom);
+
+  if (!site)
+    site = fun;
+
+  alloc_sample_countdown = alloc_sample_interval;
+
+  if (4 * (alloc_sites_fill + 1) > 3 * alloc_sites_size) {
+    struct alloc_site *osites = alloc_sites;
+    cnum i, osize = alloc_sites_size;
+
+    alloc_sites_size = if3(osize != 0, 2 * osize, 64);
+    alloc_sites = coerce(struct alloc_site *,
+                         chk_calloc(alloc_sites_size, sizeof *alloc_sites));
+    alloc_sites_fill = 0;
+
+    for (i = 0; i < osize; i++)
+      if (osites[i].samples != 0)
+        alloc_site_add(osites[i].site, osites[i].samples);
+
+    free(osites);
+  }
+
+  alloc_site_add(site, 1);
+}
+
+/*
+ * Called on every allocation: takes an allocation sample when one
+ * is due, and collects garbage when it is time to do so.
+ */
+static void alloc_check(void)
 {
-  int tries;
   alloc_bytes_t malloc_delta = malloc_bytes - prev_malloc_bytes;
   assert (!async_sig_enabled);
 
+  if (alloc_sample_countdown > 0 && --alloc_sample_countdown == 0)
+    alloc_sample();
+
 #if CONFIG_GEN_GC
-  if ((opt_gc_debug || freshobj_idx >= FRESHOBJ_VEC_SIZE ||
-       malloc_delta >= opt_gc_delta) &&
-      gc_enabled)
+  if (inc_marking) {
+    if (--inc_countdown <= 0 && gc_enabled)
+      inc_step();
+  } else if ((opt_gc_debug || young_count >= NURSERY_SIZE ||
+              malloc_delta >= opt_gc_delta) &&
+             gc_enabled)
   {
-    gc();
+    gc_auto();
   }
-
-  if (freshobj_idx >= FRESHOBJ_VEC_SIZE)
-    full_gc = 1;
 #else
   if ((opt_gc_debug || malloc_delta >= opt_gc_delta) && gc_enabled) {
     gc();
   }
 #endif
+}
+
+/*
+ * Called when an allocation finds the free list empty, on the given try:
+ * either adds a heap by means of the grow function, or collects garbage.
+ */
+static void alloc_refill(int tries, void (*grow)(void))
+{
+#if CONFIG_GEN_GC
+  if (!full_gc && young_count < NURSERY_SIZE) {
+    grow();
+    return;
+  }
+
+  /* Objects allocated during incremental marking come from new heaps,
+     within limits; then the collection is finished at once. */
+  if (inc_marking && inc_grow > 0) {
+    inc_grow--;
+    grow();
+    return;
+  }
+#endif
+
+  switch (tries) {
+  case 0:
+    if (gc_enabled) {
+#if CONFIG_GEN_GC
+      gc_auto();
+#else
+      gc();
+#endif
+      break;
+    }
+    /* fallthrough */
+  case 1:
+    grow();
+    break;
+  }
+}
+
+#if CONFIG_GEN_GC
+
+/*
+ * The nursery.
+ *
+ * The young objects, allocated since the last collection, are found in
+ * the heaps on the young list, to which a heap is added when an object is
+ * first allocated from it. Since every object which survives a collection
+ * is promoted, the young objects are those in these heaps which are in
+ * generation zero, or noted with -1 by gc_set. A minor collection sweeps
+ * only the young heaps. A new heap is allocated from by bumping a pointer,
+ * so that the young objects in it are packed together. The number of
+ * objects allocated is counted, and when it reaches NURSERY_SIZE, a minor
+ * collection is due.
+ */
+
+static void young_add(heap_t *heap)
+{
+  young_last = heap;
+  if (!heap->young) {
+    heap->young = 1;
+    heap->young_next = young_list;
+    young_list = heap;
+  }
+}
+
+#if CONFIG_COMPACT_CONS
+
+static void cons_young_add(cons_heap_t *heap)
+{
+  cons_young_last = heap;
+  if (!heap->young) {
+    heap->young = 1;
+    heap->young_next = cons_young_list;
+    cons_young_list = heap;
+  }
+}
+
+#endif
+
+static void young_reset(void)
+{
+  heap_t *heap;
+#if CONFIG_COMPACT_CONS
+  cons_heap_t *cheap;
+
+  for (cheap = cons_young_list; cheap != 0; cheap = cheap->young_next)
+    cheap->young = 0;
+  cons_young_list = cons_young_last = 0;
+#endif
+
+  for (heap = young_list; heap != 0; heap = heap->young_next)
+    heap->young = 0;
+  young_list = young_last = 0;
+  young_count = 0;
+}
+
+#endif
+
+val make_obj(void)
+{
+  int tries;
+
+  alloc_check();
 
   for (tries = 0; tries < 3; tries++) {
-    if (free_list) {
-      val ret = free_list;
+    val ret;
+
+#if CONFIG_GEN_GC
+    while (free_list == 0 && bump_next == bump_end && sweep_next != 0)
+      sweep_lazy();
+#endif
+
+    if (bump_next < bump_end) {
+      ret = bump_next++;
+    } else if (free_list) {
+      ret = free_list;
 #if HAVE_VALGRIND
       if (opt_vg_debug)
         VALGRIND_MAKE_MEM_DEFINED(free_list, sizeof *free_list);
@@ -203,53 +756,95 @@ val make_obj(void)
 
       if (free_list == 0)
         free_tail = &free_list;
+    } else {
+      alloc_refill(tries, more);
+      continue;
+    }
+
 #if HAVE_VALGRIND
-      if (opt_vg_debug)
-        VALGRIND_MAKE_MEM_UNDEFINED(ret, sizeof *ret);
+    if (opt_vg_debug)
+      VALGRIND_MAKE_MEM_UNDEFINED(ret, sizeof *ret);
 #endif
 #if CONFIG_GEN_GC
-      ret->t.gen = 0;
-      if (!full_gc)
-        freshobj[freshobj_idx++] = ret;
+    ret->t.gen = 0;
+    if (!full_gc) {
+      heap_t *heap = heap_of(ret);
+      if (heap != young_last)
+        young_add(heap);
+      young_count++;
+    }
 #endif
-      gc_bytes += sizeof (obj_t);
+    gc_bytes += sizeof (obj_t);
 #if CONFIG_EXTRA_DEBUGGING
-      if (ret == break_obj) {
+    if (ret == break_obj) {
 #if HAVE_VALGRIND
-        VALGRIND_PRINTF_BACKTRACE("object %p allocated\n", convert(void *, ret));
-#endif
-        breakpt();
-      }
+      VALGRIND_PRINTF_BACKTRACE("object %p allocated\n", convert(void *, ret));
 #endif
-      return ret;
+      breakpt();
     }
+#endif
+    return ret;
+  }
+
+  abort();
+}
+
+val make_cons_obj(void)
+{
+#if CONFIG_COMPACT_CONS
+  int tries;
+
+  alloc_check();
+
+  for (tries = 0; tries < 3; tries++) {
+    val ret, hdr;
 
 #if CONFIG_GEN_GC
-    if (!full_gc && freshobj_idx < FRESHOBJ_VEC_SIZE) {
-      more();
+    while (cons_free_list == 0 && cons_bump_next == cons_bump_end &&
+           cons_sweep_next != 0)
+      sweep_lazy_conses();
+#endif
+
+    if (cons_bump_next < cons_bump_end) {
+      ret = cons_of_cell(cons_bump_next++);
+    } else if (cons_free_list) {
+      ret = cons_free_list;
+      cons_free_list = ret->c.car;
+    } else {
+      alloc_refill(tries, more_conses);
       continue;
     }
-#endif
 
-    switch (tries) {
-    case 0:
-      if (gc_enabled) {
-        gc();
-        break;
-      }
-      /* fallthrough */
-    case 1:
-      more();
-      break;
+    hdr = header(ret);
+    hdr->t.type = CONS;
+#if CONFIG_GEN_GC
+    hdr->t.gen = 0;
+    if (!full_gc) {
+      cons_heap_t *heap = cons_heap_of(ret);
+      if (heap != cons_young_last)
+        cons_young_add(heap);
+      young_count++;
     }
+#endif
+    gc_bytes += sizeof (struct cons_cell);
+#if CONFIG_EXTRA_DEBUGGING
+    if (ret == break_obj)
+      breakpt();
+#endif
+    return ret;
   }
 
   abort();
+#else
+  val obj = make_obj();
+  obj->c.type = CONS;
+  return obj;
+#endif
 }
 
 static void finalize(val obj)
 {
-  switch (convert(type_t, obj->t.type)) {
+  switch (convert(type_t, header(obj)->t.type)) {
   case NIL:
   case CONS:
   case CHR:
@@ -306,40 +901,195 @@ void cobj_destroy_free_op(val obj)
   free(obj->co.handle);
 }
 
-static void mark_obj(val obj)
-{
-  type_t t;
-
-#if 1
-tail_call:
-#define mark_obj_tail(o) do { obj = (o); goto tail_call; } while (0)
+/*
+ * The header word of an object, as copied out of the object in order
+ * to be updated, or compared and swapped, as a whole.
+ */
+union mark_hdr {
+  struct { obj_common; } h;
+  unsigned int w;
+};
+
+/*
+ * Give the header in hdr its marked form. Returns zero if the object is
+ * already marked, or is in the mature generation and not subject to
+ * a partial collection.
+ */
+static int mark_header(union mark_hdr *hdr)
+{
+#if CONFIG_GEN_GC
+  if (full_gc) {
+    if ((hdr->h.mark & MARK_FULL) != 0)
+      return 0;
+  } else if ((hdr->h.type & REACHABLE) != 0 || hdr->h.gen > 0) {
+    return 0;
+  }
 #else
-#define mark_obj_tail(o) return mark_obj(o)
+  if ((hdr->h.type & REACHABLE) != 0)
+    return 0;
 #endif
 
-  if (!is_ptr(obj))
-    return;
+  if ((hdr->h.type & FREE) != 0)
+    abort();
+
+#if CONFIG_GEN_GC
+  if (full_gc) {
+    hdr->h.mark |= MARK_FULL;
+    hdr->h.gen = 1;
+    return 1;
+  }
 
-  t = obj->t.type;
+  if (hdr->h.gen == -1)
+    hdr->h.gen = 0;  /* Will be promoted to generation 1 by sweep_one */
+#endif
 
-  if ((t & REACHABLE) != 0)
-    return;
+  hdr->h.type = convert(type_t, hdr->h.type | REACHABLE);
+  return 1;
+}
 
-#if CONFIG_GEN_GC
-  if (!full_gc && obj->t.gen > 0)
-    return;
+static int mark_set_reachable(val obj)
+{
+  union mark_hdr hdr;
+  val head = header(obj);
+
+  memcpy(&hdr, head, sizeof hdr);
+
+  if (!mark_header(&hdr))
+    return 0;
+
+  memcpy(head, &hdr, sizeof hdr);
+  return 1;
+}
+
+void cobj_mark_op(val obj)
+{
+}
+
+/*
+ * Marking with an explicit stack of gray objects. An object is grayed
+ * when it is first found to be reachable, and turns black when it is
+ * popped and its children are grayed in turn by mark_scan. If other
+ * markers run concurrently, the mode of the stack calls for an atomic
+ * update of the header word.
+ *
+ * The stop-the-world marker uses the deferred mode: children are pushed
+ * without being looked at, and an object is marked when it is popped.
+ * Popped objects pass through a small queue before they are marked,
+ * while their headers are prefetched into the cache.
+ *
+ * While mark_cur is set, gc_mark grays objects onto that stack; thus the
+ * mark functions of COBJ and CPTR objects take part in all modes.
+ */
+
+enum mark_mode { mark_plain, mark_atomic, mark_deferred };
+
+struct mark_stack {
+  val *stack;
+  cnum top, size;
+  enum mark_mode mode;
+};
+
+static struct mark_stack *mark_cur;
+static struct mark_stack mark_seq = { 0, 0, 0, mark_deferred };
+
+#ifdef __GNUC__
+#define mark_prefetch(obj) __builtin_prefetch(obj, 1)
+#else
+#define mark_prefetch(obj) ((void) 0)
 #endif
 
-  if ((t & FREE) != 0)
-    abort();
+static void mark_push(struct mark_stack *ms, val obj)
+{
+  if (ms->top >= ms->size) {
+    cnum size = ms->size ? 2 * ms->size : MARK_PACKET_SIZE;
+    val *stack = coerce(val *, realloc(ms->stack, size * sizeof *stack));
+    if (stack == 0)
+      abort();
+    ms->stack = stack;
+    ms->size = size;
+  }
 
-#if CONFIG_GEN_GC
-  if (obj->t.gen == -1)
-    obj->t.gen = 0;  /* Will be promoted to generation 1 by sweep_one */
+  ms->stack[ms->top++] = obj;
+}
+
+#if HAVE_PTHREADS
+
+/*
+ * Parallel marking.
+ *
+ * During a full collection of a large heap, the roots are gathered onto
+ * a mark stack, and then a pool of marker threads traces the object graph.
+ * Each marker owns a private stack of gray objects. An object is grayed
+ * by whichever thread first marks its header, which is done with a
+ * compare-and-swap of the header word.  When some markers are idle, a busy
+ * marker moves a packet of entries from the top of its stack into a
+ * shared pool, from which the idle ones take their work. Marking is done
+ * when every marker is idle and the pool is empty.
+ *
+ * The mark functions of COBJ and CPTR objects may record global state (for
+ * instance, the list of reachable hash tables) so they are called under a
+ * lock.
+ */
+
+struct mark_packet {
+  struct mark_packet *next;
+  val obj[MARK_PACKET_SIZE];
+};
+
+static pthread_mutex_t pm_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pm_cond = PTHREAD_COND_INITIALIZER;
+static pthread_mutex_t pm_cobj_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct mark_packet *pm_pool;
+static volatile int pm_idle;
+static int pm_nworkers, pm_done;
+
+static int par_set_reachable(val obj)
+{
+  volatile unsigned int *word = coerce(volatile unsigned int *, header(obj));
+
+  for (;;) {
+    union mark_hdr ohdr, nhdr;
+
+    ohdr.w = *word;
+    nhdr = ohdr;
+
+    if (!mark_header(&nhdr))
+      return 0;
+
+    if (__sync_bool_compare_and_swap(word, ohdr.w, nhdr.w))
+      return 1;
+  }
+}
+
+#endif
+
+static void mark_grey(struct mark_stack *ms, val obj)
+{
+  int reached;
+
+  if (!is_ptr(obj))
+    return;
+
+  switch (ms->mode) {
+  case mark_deferred:
+    mark_push(ms, obj);
+    return;
+#if HAVE_PTHREADS
+  case mark_atomic:
+    reached = par_set_reachable(obj);
+    break;
 #endif
+  default:
+    reached = mark_set_reachable(obj);
+    break;
+  }
 
-  obj->t.type = convert(type_t, t | REACHABLE);
+  if (reached)
+    mark_push(ms, obj);
+}
 
+static void mark_scan(struct mark_stack *ms, val obj)
+{
 #if CONFIG_EXTRA_DEBUGGING
   if (obj == break_obj) {
 #if HAVE_VALGRIND
@@ -349,7 +1099,7 @@ tail_call:
   }
 #endif
 
-  switch (t) {
+  switch (convert(type_t, header(obj)->t.type & ~REACHABLE)) {
   case NIL:
   case CHR:
   case NUM:
@@ -358,74 +1108,271 @@ tail_call:
   case FLNUM:
     return;
   case CONS:
-    mark_obj(obj->c.car);
-    mark_obj_tail(obj->c.cdr);
+    mark_grey(ms, obj->c.cdr);
+    mark_grey(ms, obj->c.car);
+    return;
   case STR:
-    mark_obj(obj->st.len);
-    mark_obj_tail(obj->st.alloc);
+    mark_grey(ms, obj->st.len);
+    mark_grey(ms, obj->st.alloc);
+    return;
   case SYM:
-    mark_obj(obj->s.name);
-    mark_obj_tail(obj->s.package);
+    mark_grey(ms, obj->s.name);
+    mark_grey(ms, obj->s.package);
+    return;
   case PKG:
-    mark_obj(obj->pk.name);
-    mark_obj(obj->pk.hidhash);
-    mark_obj_tail(obj->pk.symhash);
+    mark_grey(ms, obj->pk.name);
+    mark_grey(ms, obj->pk.hidhash);
+    mark_grey(ms, obj->pk.symhash);
+    return;
   case FUN:
     switch (obj->f.functype) {
     case FINTERP:
-      mark_obj(obj->f.f.interp_fun);
+      mark_grey(ms, obj->f.f.interp_fun);
       break;
     case FVM:
-      mark_obj(obj->f.f.vm_desc);
+      mark_grey(ms, obj->f.f.vm_desc);
       break;
     }
-    mark_obj_tail(obj->f.env);
+    mark_grey(ms, obj->f.env);
+    return;
   case VEC:
     {
       val alloc_size = obj->v.vec[vec_alloc];
       val len = obj->v.vec[vec_length];
       cnum i, fp = c_num(len);
 
-      mark_obj(alloc_size);
-      mark_obj(len);
+      mark_grey(ms, alloc_size);
+      mark_grey(ms, len);
 
       for (i = 0; i < fp; i++)
-        mark_obj(obj->v.vec[i]);
+        mark_grey(ms, obj->v.vec[i]);
     }
     return;
   case LCONS:
-    mark_obj(obj->lc.func);
-    mark_obj(obj->lc.car);
-    mark_obj_tail(obj->lc.cdr);
+    mark_grey(ms, obj->lc.func);
+    mark_grey(ms, obj->lc.car);
+    mark_grey(ms, obj->lc.cdr);
+    return;
   case LSTR:
-    mark_obj(obj->ls.prefix);
-    mark_obj(obj->ls.props->limit);
-    mark_obj(obj->ls.props->term);
-    mark_obj_tail(obj->ls.list);
+    mark_grey(ms, obj->ls.prefix);
+    mark_grey(ms, obj->ls.props->limit);
+    mark_grey(ms, obj->ls.props->term);
+    mark_grey(ms, obj->ls.list);
+    return;
   case COBJ:
   case CPTR:
-    obj->co.ops->mark(obj);
-    mark_obj_tail(obj->co.cls);
+    {
+      struct mark_stack *saved = mark_cur;
+#if HAVE_PTHREADS
+      if (ms->mode == mark_atomic)
+        pthread_mutex_lock(&pm_cobj_lock);
+#endif
+      mark_cur = ms;
+      obj->co.ops->mark(obj);
+      mark_cur = saved;
+#if HAVE_PTHREADS
+      if (ms->mode == mark_atomic)
+        pthread_mutex_unlock(&pm_cobj_lock);
+#endif
+    }
+    mark_grey(ms, obj->co.cls);
+    return;
   case ENV:
-    mark_obj(obj->e.vbindings);
-    mark_obj(obj->e.fbindings);
-    mark_obj_tail(obj->e.up_env);
+    mark_grey(ms, obj->e.vbindings);
+    mark_grey(ms, obj->e.fbindings);
+    mark_grey(ms, obj->e.up_env);
+    return;
   case RNG:
-    mark_obj(obj->rn.from);
-    mark_obj_tail(obj->rn.to);
+    mark_grey(ms, obj->rn.from);
+    mark_grey(ms, obj->rn.to);
+    return;
   case BUF:
-    mark_obj(obj->b.len);
-    mark_obj_tail(obj->b.size);
+    mark_grey(ms, obj->b.len);
+    mark_grey(ms, obj->b.size);
+    return;
   }
 
   assert (0 && "corrupt type field");
 }
 
-void cobj_mark_op(val obj)
+static void mark_drain_deferred(struct mark_stack *ms)
+{
+  val queue[MARK_PREFETCH_DEPTH];
+  int head = 0, fill = 0;
+
+  for (;;) {
+    val obj;
+
+    if (ms->top > 0) {
+      val next = ms->stack[--ms->top];
+      mark_prefetch(next);
+#if CONFIG_COMPACT_CONS
+      if (is_compact_cons(next))
+        mark_prefetch(header(next));
+#endif
+      if (fill < MARK_PREFETCH_DEPTH) {
+        queue[(head + fill++) % MARK_PREFETCH_DEPTH] = next;
+        continue;
+      }
+      obj = queue[head];
+      queue[head] = next;
+    } else if (fill > 0) {
+      obj = queue[head];
+      fill--;
+    } else {
+      break;
+    }
+
+    head = (head + 1) % MARK_PREFETCH_DEPTH;
+
+    if (mark_set_reachable(obj))
+      mark_scan(ms, obj);
+  }
+}
+
+static void mark_drain(struct mark_stack *ms)
+{
+  if (ms->mode == mark_deferred) {
+    mark_drain_deferred(ms);
+    return;
+  }
+
+  while (ms->top > 0)
+    mark_scan(ms, ms->stack[--ms->top]);
+}
+
+static void mark_obj(val obj)
+{
+  mark_grey(&mark_seq, obj);
+  mark_drain(&mark_seq);
+}
+
+#if HAVE_PTHREADS
+
+static void par_share(struct mark_stack *ms)
 {
+  struct mark_packet *pkt = coerce(struct mark_packet *,
+                                   malloc(sizeof *pkt));
+
+  if (pkt == 0)
+    return;
+
+  ms->top -= MARK_PACKET_SIZE;
+  memcpy(pkt->obj, ms->stack + ms->top, sizeof pkt->obj);
+
+  pthread_mutex_lock(&pm_lock);
+  pkt->next = pm_pool;
+  pm_pool = pkt;
+  pthread_cond_signal(&pm_cond);
+  pthread_mutex_unlock(&pm_lock);
 }
 
-static int in_heap(val ptr)
+static void par_drain(struct mark_stack *ms)
+{
+  for (;;) {
+    struct mark_packet *pkt;
+    int i;
+
+    while (ms->top > 0) {
+      if (pm_idle > 0 && ms->top >= 2 * MARK_PACKET_SIZE)
+        par_share(ms);
+      mark_scan(ms, ms->stack[--ms->top]);
+    }
+
+    pthread_mutex_lock(&pm_lock);
+
+    pm_idle++;
+
+    while (!pm_pool && !pm_done) {
+      if (pm_idle == pm_nworkers) {
+        pm_done = 1;
+        pthread_cond_broadcast(&pm_cond);
+      } else {
+        pthread_cond_wait(&pm_cond, &pm_lock);
+      }
+    }
+
+    if (pm_done) {
+      pthread_mutex_unlock(&pm_lock);
+      return;
+    }
+
+    pm_idle--;
+    pkt = pm_pool;
+    pm_pool = pkt->next;
+    pthread_mutex_unlock(&pm_lock);
+
+    for (i = 0; i < MARK_PACKET_SIZE; i++)
+      mark_push(ms, pkt->obj[i]);
+
+    free(pkt);
+  }
+}
+
+static void *par_worker(void *arg)
+{
+  struct mark_stack *ms = coerce(struct mark_stack *, arg);
+  par_drain(ms);
+  return 0;
+}
+
+static void par_mark(struct mark_stack *roots)
+{
+  pthread_t tid[PAR_MARK_MAX_THREADS];
+  struct mark_stack ws[PAR_MARK_MAX_THREADS];
+  int nthreads = opt_gc_threads, i;
+  sigset_t all, saved;
+
+  if (nthreads > PAR_MARK_MAX_THREADS)
+    nthreads = PAR_MARK_MAX_THREADS;
+
+  pm_pool = 0;
+  pm_idle = 0;
+  pm_done = 0;
+  pm_nworkers = nthreads;
+
+  /* Markers must not take asynchronous signals meant for the mutator. */
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &saved);
+
+  for (i = 1; i < nthreads; i++) {
+    ws[i].stack = 0;
+    ws[i].top = ws[i].size = 0;
+    ws[i].mode = mark_atomic;
+    if (pthread_create(&tid[i], 0, par_worker, &ws[i]) != 0)
+      break;
+  }
+
+  pthread_sigmask(SIG_SETMASK, &saved, 0);
+
+  if (i < nthreads) {
+    pthread_mutex_lock(&pm_lock);
+    nthreads = pm_nworkers = i;
+    pthread_cond_broadcast(&pm_cond);
+    pthread_mutex_unlock(&pm_lock);
+  }
+
+  roots->mode = mark_atomic;
+  par_drain(roots);
+
+  for (i = 1; i < nthreads; i++) {
+    pthread_join(tid[i], 0);
+    free(ws[i].stack);
+  }
+}
+
+static int par_mark_p(void)
+{
+#if CONFIG_GEN_GC
+  if (!full_gc)
+    return 0;
+#endif
+  return opt_gc_threads > 1 && heap_count >= PAR_MARK_MIN_HEAPS;
+}
+
+#endif
+
+static heap_t *in_heap(val ptr)
 {
   heap_t *heap;
 
@@ -438,25 +1385,97 @@ static int in_heap(val ptr)
   for (heap = heap_list; heap != 0; heap = heap->next) {
     if (ptr >= heap->block && ptr < heap->block + HEAP_SIZE)
       if ((coerce(char *, ptr) - coerce(char *, heap->block)) % sizeof (obj_t) == 0)
-        return 1;
+        return heap;
   }
 
   return 0;
 }
 
+#if CONFIG_COMPACT_CONS
+
+static cons_heap_t *in_cons_heap(val ptr)
+{
+  struct cons_cell *cell;
+  cons_heap_t *heap, *iter;
+
+  if (!is_compact_cons(ptr))
+    return 0;
+
+  cell = cons_cell_of(ptr);
+
+  if (cell < cons_min_bound || cell >= cons_max_bound)
+    return 0;
+
+  heap = cons_heap_of(ptr);
+
+  if (cell >= heap->block + CONS_HEAP_SIZE)
+    return 0;
+
+  for (iter = cons_heap_list; iter != 0; iter = iter->next)
+    if (iter == heap)
+      return heap;
+
+  return 0;
+}
+
+#endif
+
+/*
+ * An object which the last full collection left unmarked, in a heap
+ * that is still waiting to be lazily swept, is garbage which is not
+ * yet on the free list. It must not be revived by conservative marking.
+ */
+static int is_lazy_garbage(heap_t *heap, val obj)
+{
+#if CONFIG_GEN_GC
+  return heap->unswept && (obj->t.mark & MARK_FULL) == 0;
+#else
+  (void) heap;
+  (void) obj;
+  return 0;
+#endif
+}
+
+#if CONFIG_COMPACT_CONS
+
+static int is_lazy_garbage_cons(cons_heap_t *heap, val cons)
+{
+#if CONFIG_GEN_GC
+  return heap->unswept && (header(cons)->t.mark & MARK_FULL) == 0;
+#else
+  (void) heap;
+  (void) cons;
+  return 0;
+#endif
+}
+
+#endif
+
 static void mark_obj_maybe(val maybe_obj)
 {
+  heap_t *heap;
+#if CONFIG_COMPACT_CONS
+  cons_heap_t *cheap;
+#endif
 #if HAVE_VALGRIND
   VALGRIND_MAKE_MEM_DEFINED(&maybe_obj, sizeof maybe_obj);
 #endif
-  if (in_heap(maybe_obj)) {
+#if CONFIG_COMPACT_CONS
+  if ((cheap = in_cons_heap(maybe_obj)) != 0) {
+    type_t t = header(maybe_obj)->t.type;
+    if ((t & FREE) == 0 && !is_lazy_garbage_cons(cheap, maybe_obj))
+      gc_mark(maybe_obj);
+    return;
+  }
+#endif
+  if ((heap = in_heap(maybe_obj)) != 0) {
 #if HAVE_VALGRIND
     if (opt_vg_debug)
       VALGRIND_MAKE_MEM_DEFINED(maybe_obj, SIZEOF_PTR);
 #endif
     type_t t = maybe_obj->t.type;
-    if ((t & FREE) == 0) {
-      mark_obj(maybe_obj);
+    if ((t & FREE) == 0 && !is_lazy_garbage(heap, maybe_obj)) {
+      gc_mark(maybe_obj);
     } else {
 #if HAVE_VALGRIND
       if (opt_vg_debug)
@@ -478,15 +1497,46 @@ static void mark_mem_region(val *low, val *high)
     mark_obj_maybe(*low);
 }
 
+static void mark_alloc_sites(void)
+{
+  cnum i;
+
+  for (i = 0; i < alloc_sites_size; i++)
+    if (alloc_sites[i].samples != 0)
+      gc_mark(alloc_sites[i].site);
+}
+
 static void mark(mach_context_t *pmc, val *gc_stack_top)
 {
   val **rootloc;
+  int seq;
+#if HAVE_PTHREADS
+  struct mark_stack roots = { 0, 0, 0, mark_plain };
+  int par = !mark_cur && par_mark_p();
+
+  /*
+   * In parallel mode, the roots are only grayed here, onto
+   * the roots stack, and traced afterward by par_mark.
+   */
+  if (par)
+    mark_cur = &roots;
+#endif
+
+  /*
+   * Otherwise, unless an incremental cycle is gathering the roots,
+   * they are pushed onto the sequential mark stack, and traced
+   * all together at the end.
+   */
+  if ((seq = !mark_cur) != 0)
+    mark_cur = &mark_seq;
 
   /*
    * First, scan the officially registered locations.
    */
   for (rootloc = prot_stack; rootloc != gc_prot_top; rootloc++)
-    mark_obj(**rootloc);
+    gc_mark(**rootloc);
+
+  mark_alloc_sites();
 
 #if CONFIG_GEN_GC
   /*
@@ -496,9 +1546,9 @@ static void mark(mach_context_t *pmc, val *gc_stack_top)
   {
     int i;
     for (i = 0; i < checkobj_idx; i++)
-      mark_obj(checkobj[i]);
+      gc_mark(checkobj[i]);
     for (i = 0; i < mutobj_idx; i++)
-      mark_obj(mutobj[i]);
+      gc_mark(mutobj[i]);
   }
 #endif
 
@@ -511,9 +1561,183 @@ static void mark(mach_context_t *pmc, val *gc_stack_top)
    * Finally, the stack.
    */
   mark_mem_region(gc_stack_top - STACK_TOP_EXTRA_WORDS, gc_stack_bottom);
+
+  if (seq) {
+    mark_cur = 0;
+    mark_drain(&mark_seq);
+
+    if (mark_seq.size > MARK_STACK_KEEP) {
+      free(mark_seq.stack);
+      mark_seq.stack = 0;
+      mark_seq.size = 0;
+    }
+  }
+
+#if HAVE_PTHREADS
+  if (par) {
+    mark_cur = 0;
+    par_mark(&roots);
+    free(roots.stack);
+  }
+#endif
 }
 
-static int sweep_one(obj_t *block)
+static cnum gc_usec_since(struct timeval *start)
+{
+  struct timeval now;
+  gettimeofday(&now, 0);
+  return (now.tv_sec - start->tv_sec) * 1000000 +
+         (now.tv_usec - start->tv_usec);
+}
+
+static cnum gc_note_pause(struct timeval *start)
+{
+  cnum pause = gc_usec_since(start);
+  ucnum bits = pause;
+  int i;
+
+  if (pause > gc_max_pause)
+    gc_max_pause = pause;
+
+  for (i = 0; bits != 0 && i < GC_PAUSE_BUCKETS - 1; i++)
+    bits >>= 1;
+
+  gc_stats.pause_hist[i]++;
+  gc_stats.pause_usec += pause;
+  gc_stats.pauses++;
+
+  return pause;
+}
+
+static void gc_log(struct gc_log_rec *rec)
+{
+  fprintf(stderr, "gc %lu %s: mark %ld us, sweep %ld us, pause %ld us, "
+          "freed %lu, heaps %ld\n",
+          convert(unsigned long, rec->serial), rec->kind,
+          convert(long, rec->mark_usec), convert(long, rec->sweep_usec),
+          convert(long, rec->pause_usec), convert(unsigned long, rec->freed),
+          convert(long, heap_count));
+}
+
+#if CONFIG_GEN_GC
+
+/*
+ * Incremental collection.
+ *
+ * When a pause budget is set, a full collection is carried out as a
+ * cycle of steps rather than all at once. The first step grays the roots.
+ * Thereafter, every INC_SLICE_ALLOCS allocations, make_obj calls inc_step
+ * to trace gray objects until the budget is used up. Meanwhile, gc_set
+ * grays every value which the mutator stores into an object, and gc_mutated
+ * notes marked objects whose contents are being altered in other ways, so
+ * that they are scanned again. Objects allocated during the cycle start out
+ * white. When the gray stack runs out, gc finishes the cycle in one pause:
+ * the roots and the altered objects are scanned once more, and whatever
+ * they lead to is traced, before weak processing, finalization and sweeping.
+ * Since the cycle is a full collection, the generational barrier is idle,
+ * and the marks are kept in the mark field, out of the mutator's way.
+ */
+
+static struct mark_stack inc_gray = { 0, 0, 0, mark_plain };
+static struct mark_stack inc_dirty = { 0, 0, 0, mark_plain };
+
+static void inc_start(void)
+{
+  val gc_stack_top = nil;
+  mach_context_t mc;
+  struct timeval start, phase;
+
+  gettimeofday(&start, 0);
+
+  assert (gc_enabled);
+
+  if (inprogress++)
+    assert(0 && "gc re-entered");
+
+  full_gc = 1;
+  checkobj_idx = 0;
+  mutobj_idx = 0;
+  young_reset();
+
+  sweep_finish();
+
+  gettimeofday(&phase, 0);
+  save_context(mc);
+  gc_enabled = 0;
+  rcyc_empty();
+  mark_cur = &inc_gray;
+  mark(&mc, &gc_stack_top);
+  mark_cur = 0;
+  inc_mark_usec = gc_usec_since(&phase);
+
+  inc_marking = 1;
+  inc_countdown = INC_SLICE_ALLOCS;
+  inc_grow = heap_count / 2 + 1;
+
+  gc_enabled = 1;
+  inprogress--;
+
+  gc_note_pause(&start);
+}
+
+static void inc_step(void)
+{
+  struct timeval start;
+  cnum work = 0;
+
+  gettimeofday(&start, 0);
+
+  inprogress++;
+  gc_enabled = 0;
+  mark_cur = &inc_gray;
+
+  while (inc_gray.top > 0) {
+    mark_scan(&inc_gray, inc_gray.stack[--inc_gray.top]);
+    if (++work % INC_CHECK_WORK == 0 &&
+        gc_usec_since(&start) >= opt_gc_pause)
+      break;
+  }
+
+  mark_cur = 0;
+  gc_enabled = 1;
+  inprogress--;
+
+  inc_countdown = INC_SLICE_ALLOCS;
+  inc_mark_usec += gc_usec_since(&start);
+  gc_stats.steps++;
+
+  /* The step and the end of the cycle make up one pause. */
+  if (inc_gray.top == 0)
+    gc_collect(&start);
+  else
+    gc_note_pause(&start);
+}
+
+static void inc_finish(mach_context_t *pmc, val *gc_stack_top)
+{
+  mark_cur = &inc_gray;
+  mark(pmc, gc_stack_top);
+
+  while (inc_dirty.top > 0)
+    mark_scan(&inc_gray, inc_dirty.stack[--inc_dirty.top]);
+
+  mark_drain(&inc_gray);
+  mark_cur = 0;
+  inc_marking = 0;
+}
+
+static void gc_auto(void)
+{
+  if (opt_gc_pause > 0 && !opt_gc_debug && !inc_marking &&
+      (full_gc || malloc_bytes - prev_malloc_bytes >= opt_gc_delta))
+    inc_start();
+  else
+    gc();
+}
+
+#endif
+
+static void free_add(obj_t *block)
 {
 #if HAVE_VALGRIND
   const int vg_dbg = opt_vg_debug;
@@ -521,133 +1745,549 @@ static int sweep_one(obj_t *block)
   const int vg_dbg = 0;
 #endif
 
+#if CONFIG_COMPACT_CONS
+  if (is_compact_cons(block)) {
+    block->c.car = cons_free_list;
+    cons_free_list = block;
+    return;
+  }
+#endif
+
+  /* If debugging is turned on, we want to catch instances
+     where a reachable object is wrongly freed. This is difficult
+     to do if the object is recycled soon after.
+     So when debugging is on, the free list is FIFO
+     rather than LIFO, which increases our chances that the
+     code which is still using the object will trip on
+     the freed object before it is recycled. */
+  if (vg_dbg || opt_gc_debug) {
+#if HAVE_VALGRIND
+    if (vg_dbg && free_tail != &free_list)
+      VALGRIND_MAKE_MEM_DEFINED(free_tail, sizeof *free_tail);
+#endif
+    *free_tail = block;
+    block->t.next = nil;
+#if HAVE_VALGRIND
+    if (vg_dbg) {
+      if (free_tail != &free_list)
+        VALGRIND_MAKE_MEM_NOACCESS(free_tail, sizeof *free_tail);
+      VALGRIND_MAKE_MEM_NOACCESS(block, sizeof *block);
+    }
+#endif
+    free_tail = &block->t.next;
+  } else {
+    block->t.next = free_list;
+    free_list = block;
+  }
+}
+
+static int sweep_dead(obj_t *block)
+{
+  val hdr = header(block);
+
+  if (hdr->t.type & FREE) {
+#if HAVE_VALGRIND
+    if (opt_vg_debug && hdr == block)
+      VALGRIND_MAKE_MEM_NOACCESS(block, sizeof *block);
+#endif
+    return 1;
+  }
+
+  finalize(block);
+  hdr->t.type = convert(type_t, hdr->t.type | FREE);
+  free_add(block);
+  gc_stats.freed++;
+  return 1;
+}
+
+static int sweep_one(obj_t *block)
+{
+  val hdr = header(block);
+
 #if CONFIG_EXTRA_DEBUGGING
   if (block == break_obj) {
 #if HAVE_VALGRIND
     VALGRIND_PRINTF_BACKTRACE("object %p swept (type = %x)\n",
                               convert(void *, block),
-                              convert(unsigned int, block->t.type));
+                              convert(unsigned int, hdr->t.type));
 #endif
     breakpt();
   }
 #endif
 
 #if CONFIG_GEN_GC
-  if (!full_gc && block->t.gen > 0)
+  if (!full_gc && hdr->t.gen > 0)
     abort();
 #endif
 
-  if ((block->t.type & (REACHABLE | FREE)) == (REACHABLE | FREE))
+  if ((hdr->t.type & (REACHABLE | FREE)) == (REACHABLE | FREE))
     abort();
 
-  if (block->t.type & REACHABLE) {
+  if ((hdr->t.type & REACHABLE) != 0) {
 #if CONFIG_GEN_GC
-    block->t.gen = 1;
+    hdr->t.gen = 1;
 #endif
-    block->t.type = convert(type_t, block->t.type & ~REACHABLE);
+    hdr->t.type = convert(type_t, hdr->t.type & ~REACHABLE);
     return 0;
   }
 
-  if (block->t.type & FREE) {
+  return sweep_dead(block);
+}
+
+/*
+ * Remove from the free list the cells which were put on it since
+ * it had the given head and tail.
+ */
+static void free_list_revert(val head, val *tail)
+{
 #if HAVE_VALGRIND
-    if (vg_dbg)
-      VALGRIND_MAKE_MEM_NOACCESS(block, sizeof *block);
+  const int vg_dbg = opt_vg_debug;
+#else
+  const int vg_dbg = 0;
 #endif
+  if (vg_dbg || opt_gc_debug) {
+#if HAVE_VALGRIND
+    if (vg_dbg && tail != &free_list)
+      VALGRIND_MAKE_MEM_DEFINED(tail, sizeof *tail);
+#endif
+    *tail = nil;
+#if HAVE_VALGRIND
+    if (vg_dbg && tail != &free_list)
+      VALGRIND_MAKE_MEM_NOACCESS(tail, sizeof *tail);
+#endif
+    free_tail = tail;
+  } else {
+    free_list = head;
+    if (free_list == 0)
+      free_tail = &free_list;
+  }
+}
+
+/*
+ * Called after a heap is swept, with an indication whether the heap was
+ * found entirely free. Returns nonzero if the heap is to be released.
+ */
+static int sweep_release_p(int *empty_sweeps, int empty)
+{
+  if (!empty) {
+    *empty_sweeps = 0;
+    sweep_live++;
+    return 0;
+  }
+
+  if (++*empty_sweeps >= HEAP_RELEASE_SWEEPS && sweep_kept >= heap_reserve) {
+    sweep_release++;
     return 1;
   }
 
-  finalize(block);
-  block->t.type = convert(type_t, block->t.type | FREE);
+  sweep_kept++;
+  return 0;
+}
+
+static int_ptr_t sweep_heap(heap_t *heap)
+{
+  int_ptr_t free_count = 0;
+  obj_t *block, *end;
+  val head = free_list, *tail = free_tail;
 
-  /* If debugging is turned on, we want to catch instances
-     where a reachable object is wrongly freed. This is difficult
-     to do if the object is recycled soon after.
-     So when debugging is on, the free list is FIFO
-     rather than LIFO, which increases our chances that the
-     code which is still using the object will trip on
-     the freed object before it is recycled. */
-  if (vg_dbg || opt_gc_debug) {
 #if HAVE_VALGRIND
-    if (vg_dbg && free_tail != &free_list)
-      VALGRIND_MAKE_MEM_DEFINED(free_tail, sizeof *free_tail);
+  if (opt_vg_debug)
+    VALGRIND_MAKE_MEM_DEFINED(&heap->block, sizeof heap->block);
+#endif
+
+  for (block = heap->block, end = heap->block + HEAP_SIZE;
+       block < end;
+       block++)
+  {
+#if CONFIG_GEN_GC
+    /* The marks of a full collection; gen was already set to 1. */
+    if (block->t.mark != 0) {
+      block->t.mark = 0;
+      continue;
+    }
+#endif
+
+    /* The free list was emptied before the sweep. */
+    if ((block->t.type & (REACHABLE | FREE)) == FREE) {
+      free_add(block);
+      free_count++;
+      continue;
+    }
+
+#if CONFIG_GEN_GC
+    free_count += sweep_dead(block);
+#else
+    free_count += sweep_one(block);
+#endif
+  }
+
+  if (sweep_release_p(&heap->empty_sweeps, free_count == HEAP_SIZE)) {
+    free_list_revert(head, tail);
+    heap->release = 1;
+    return 0;
+  }
+
+  return free_count;
+}
+
+#if CONFIG_COMPACT_CONS
+
+static int_ptr_t sweep_cons_heap(cons_heap_t *heap)
+{
+  int_ptr_t free_count = 0;
+  struct cons_cell *cell, *end;
+  val head = cons_free_list;
+
+  for (cell = heap->block, end = heap->block + CONS_HEAP_SIZE;
+       cell < end;
+       cell++)
+  {
+    val cons = cons_of_cell(cell);
+    val hdr = cons_header(heap, cell);
+
+#if CONFIG_GEN_GC
+    if (hdr->t.mark != 0) {
+      hdr->t.mark = 0;
+      continue;
+    }
+#endif
+
+    if ((hdr->t.type & (REACHABLE | FREE)) == FREE) {
+      free_add(cons);
+      free_count++;
+      continue;
+    }
+
+#if CONFIG_GEN_GC
+    free_count += sweep_dead(cons);
+#else
+    free_count += sweep_one(cons);
+#endif
+  }
+
+  if (sweep_release_p(&heap->empty_sweeps, free_count == CONS_HEAP_SIZE)) {
+    cons_free_list = head;
+    heap->release = 1;
+    return 0;
+  }
+
+  return free_count;
+}
+
+#endif
+
+static void sweep_begin(void)
+{
+  heap_reserve = heap_live / 4;
+  if (heap_reserve < HEAP_RESERVE_MIN)
+    heap_reserve = HEAP_RESERVE_MIN;
+  sweep_live = sweep_kept = sweep_release = 0;
+  free_list = 0;
+  free_tail = &free_list;
+  bump_next = bump_end = 0;
+#if CONFIG_COMPACT_CONS
+  cons_free_list = 0;
+  cons_bump_next = cons_bump_end = 0;
+#endif
+}
+
+/*
+ * Called when all heaps have been swept: release the heaps selected
+ * by sweep_heap and recompute the address bounds for in_heap.
+ */
+static void sweep_end(void)
+{
+  heap_t **pheap = &heap_list, *heap;
+  val min = 0, max = 0;
+#if CONFIG_COMPACT_CONS
+  cons_heap_t **pcheap = &cons_heap_list, *cheap;
+  struct cons_cell *cmin = 0, *cmax = 0;
+#endif
+
+  heap_live = sweep_live;
+
+  if (sweep_release == 0)
+    return;
+
+  while ((heap = *pheap) != 0) {
+    if (heap->release) {
+      *pheap = heap->next;
+      heap_count--;
+      gc_stats.releases++;
+      heap_free(heap);
+      continue;
+    }
+
+    if (min == 0 || heap->block < min)
+      min = heap->block;
+    if (heap->block + HEAP_SIZE > max)
+      max = heap->block + HEAP_SIZE;
+
+    pheap = &heap->next;
+  }
+
+  heap_min_bound = min;
+  heap_max_bound = max;
+
+#if CONFIG_COMPACT_CONS
+  while ((cheap = *pcheap) != 0) {
+    if (cheap->release) {
+      *pcheap = cheap->next;
+      heap_count--;
+      gc_stats.releases++;
+      cons_heap_free(cheap);
+      continue;
+    }
+
+    if (cmin == 0 || cheap->block < cmin)
+      cmin = cheap->block;
+    if (cheap->block + CONS_HEAP_SIZE > cmax)
+      cmax = cheap->block + CONS_HEAP_SIZE;
+
+    pcheap = &cheap->next;
+  }
+
+  cons_min_bound = cmin;
+  cons_max_bound = cmax;
+#endif
+
+  sweep_release = 0;
+}
+
+#if CONFIG_GEN_GC
+
+/*
+ * Lazy sweeping.
+ *
+ * A full collection doesn't sweep the heaps; it queues them all, and
+ * make_obj sweeps them one by one, whenever it finds the free list empty.
+ * The free list is emptied at that time, so that nothing is allocated
+ * from a queued heap; sweeping a heap adds all of its free cells back.
+ * The objects of a heap which is still queued keep their marks in the
+ * meantime; an unmarked one is garbage which has not yet been finalized
+ * and put on the free list. A minor collection leaves the queue alone,
+ * since it sweeps only the young objects, which come from heaps that are
+ * already swept. A full collection finishes the sweep before marking.
+ *
+ * When the last heap is swept, the heap grows if the full collection
+ * freed too little, as gc decides in the case of an eager sweep.
+ */
+
+static int sweep_pending(void)
+{
+#if CONFIG_COMPACT_CONS
+  return sweep_next != 0 || cons_sweep_next != 0;
+#else
+  return sweep_next != 0;
+#endif
+}
+
+/*
+ * Accounts for a lazy sweeping step which began at the given time, with
+ * the given count of freed objects; and when the last heap is swept,
+ * finishes the sweep.
+ */
+static void sweep_lazy_end(struct timeval *start, ucnum freed)
+{
+  cnum usec = gc_usec_since(start);
+
+  gc_stats.sweep_usec += usec;
+  sweep_log.sweep_usec += usec;
+  sweep_log.freed += gc_stats.freed - freed;
+
+  if (!sweep_pending()) {
+    sweep_end();
+    if (sweep_grow && sweep_freed < 3 * HEAP_SIZE / 4)
+      more();
+#if CONFIG_COMPACT_CONS
+    if (cons_sweep_grow && cons_sweep_freed < 3 * CONS_HEAP_SIZE / 4)
+      more_conses();
+#endif
+    if (opt_gc_log && sweep_log.pause_usec >= 0)
+      gc_log(&sweep_log);
+  }
+}
+
+static void sweep_lazy(void)
+{
+  heap_t *heap = sweep_next;
+  ucnum freed = gc_stats.freed;
+  struct timeval start;
+
+  gettimeofday(&start, 0);
+
+  sweep_next = heap->next;
+  heap->unswept = 0;
+  sweep_freed += sweep_heap(heap);
+
+  sweep_lazy_end(&start, freed);
+}
+
+#if CONFIG_COMPACT_CONS
+
+static void sweep_lazy_conses(void)
+{
+  cons_heap_t *heap = cons_sweep_next;
+  ucnum freed = gc_stats.freed;
+  struct timeval start;
+
+  gettimeofday(&start, 0);
+
+  cons_sweep_next = heap->next;
+  heap->unswept = 0;
+  cons_sweep_freed += sweep_cons_heap(heap);
+
+  sweep_lazy_end(&start, freed);
+}
+
+#endif
+
+static void sweep_finish(void)
+{
+  while (sweep_next != 0)
+    sweep_lazy();
+#if CONFIG_COMPACT_CONS
+  while (cons_sweep_next != 0)
+    sweep_lazy_conses();
+#endif
+}
+
+#endif
+
+#if CONFIG_GEN_GC
+
+/*
+ * Minor collection: sweep the young objects of a heap from the young list,
+ * leaving the mature ones and the free cells alone.
+ */
+static int_ptr_t sweep_young(heap_t *heap)
+{
+  int_ptr_t free_count = 0;
+  obj_t *block, *end;
+
+#if HAVE_VALGRIND
+  if (opt_vg_debug)
+    VALGRIND_MAKE_MEM_DEFINED(&heap->block, sizeof heap->block);
 #endif
-    *free_tail = block;
-    block->t.next = nil;
+
+  for (block = heap->block, end = heap->block + HEAP_SIZE;
+       block < end;
+       block++)
+  {
+    if ((block->t.type & FREE) != 0) {
 #if HAVE_VALGRIND
-    if (vg_dbg) {
-      if (free_tail != &free_list)
-        VALGRIND_MAKE_MEM_NOACCESS(free_tail, sizeof *free_tail);
-      VALGRIND_MAKE_MEM_NOACCESS(block, sizeof *block);
-    }
+      if (opt_vg_debug)
+        VALGRIND_MAKE_MEM_NOACCESS(block, sizeof *block);
 #endif
-    free_tail = &block->t.next;
-  } else {
-    block->t.next = free_list;
-    free_list = block;
+      continue;
+    }
+
+    if (block->t.gen <= 0)
+      free_count += sweep_one(block);
   }
 
-  return 1;
+  return free_count;
+}
+
+#if CONFIG_COMPACT_CONS
+
+static int_ptr_t sweep_young_conses(cons_heap_t *heap)
+{
+  int_ptr_t free_count = 0;
+  struct cons_cell *cell, *end;
+
+  for (cell = heap->block, end = heap->block + CONS_HEAP_SIZE;
+       cell < end;
+       cell++)
+  {
+    val hdr = cons_header(heap, cell);
+
+    if ((hdr->t.type & FREE) == 0 && hdr->t.gen <= 0)
+      free_count += sweep_one(cons_of_cell(cell));
+  }
+
+  return free_count;
 }
 
+#endif
+
+#endif
+
 static int_ptr_t sweep(void)
 {
   int_ptr_t free_count = 0;
   heap_t *heap;
-#if HAVE_VALGRIND
-  const int vg_dbg = opt_vg_debug;
+#if CONFIG_COMPACT_CONS
+  cons_heap_t *cheap;
 #endif
 
 #if CONFIG_GEN_GC
   if (!full_gc) {
     int i;
 
-    /* No need to mark block defined via Valgrind API; everything
-       in the freshobj is an allocated node! */
-    for (i = 0; i < freshobj_idx; i++)
-      free_count += sweep_one(freshobj[i]);
+    for (heap = young_list; heap != 0; heap = heap->young_next)
+      free_count += sweep_young(heap);
+#if CONFIG_COMPACT_CONS
+    for (cheap = cons_young_list; cheap != 0; cheap = cheap->young_next)
+      free_count += sweep_young_conses(cheap);
+#endif
+    young_reset();
 
     /* Generation 1 objects that were indicated for dangerous
        mutation must have their REACHABLE flag flipped off,
-       and must be returned to gen 1. */
+       and must be returned to gen 1, unless they were already
+       swept in a young heap. */
     for (i = 0; i < mutobj_idx; i++)
-      sweep_one(mutobj[i]);
+      if ((header(mutobj[i])->t.type & REACHABLE) != 0)
+        sweep_one(mutobj[i]);
 
     return free_count;
   }
 
-#endif
-
-  for (heap = heap_list; heap != 0; heap = heap->next) {
-    obj_t *block, *end;
+  young_reset();
 
-#if HAVE_VALGRIND
-    if (vg_dbg)
-        VALGRIND_MAKE_MEM_DEFINED(&heap->block, sizeof heap->block);
+  for (heap = heap_list; heap != 0; heap = heap->next)
+    heap->unswept = 1;
+#if CONFIG_COMPACT_CONS
+  for (cheap = cons_heap_list; cheap != 0; cheap = cheap->next)
+    cheap->unswept = 1;
 #endif
 
-    for (block = heap->block, end = heap->block + HEAP_SIZE;
-         block < end;
-         block++)
-    {
-      free_count += sweep_one(block);
-    }
-  }
+  sweep_begin();
+  sweep_next = heap_list;
+  sweep_freed = 0;
+#if CONFIG_COMPACT_CONS
+  cons_sweep_next = cons_heap_list;
+  cons_sweep_freed = 0;
+#endif
+#else
+  sweep_begin();
+  for (heap = heap_list; heap != 0; heap = heap->next)
+    free_count += sweep_heap(heap);
+#if CONFIG_COMPACT_CONS
+  cons_sweep_freed = 0;
+  for (cheap = cons_heap_list; cheap != 0; cheap = cheap->next)
+    cons_sweep_freed += sweep_cons_heap(cheap);
+#endif
+  sweep_end();
+#endif
 
   return free_count;
 }
 
 static int is_reachable(val obj)
 {
-  type_t t;
+  val hdr = header(obj);
 
 #if CONFIG_GEN_GC
-  if (!full_gc && obj->t.gen > 0)
+  if (full_gc)
+    return (hdr->t.mark & MARK_FULL) != 0;
+
+  if (hdr->t.gen > 0)
     return 1;
 #endif
 
-  t = obj->t.type;
-
-  return (t & REACHABLE) != 0;
+  return (hdr->t.type & REACHABLE) != 0;
 }
 
 static void prepare_finals(void)
@@ -663,7 +2303,7 @@ static void prepare_finals(void)
   for (f = final_list; f; f = f->next) {
     if (!f->reachable) {
 #if CONFIG_GEN_GC
-      f->obj->t.gen = 0;
+      header(f->obj)->t.gen = 0;
 #endif
       mark_obj(f->obj);
     }
@@ -721,16 +2361,24 @@ static void call_finals(void)
   (void) call_finalizers_impl(nil, is_unreachable_final);
 }
 
-void gc(void)
+static void gc_collect(struct timeval *start)
 {
   val gc_stack_top = nil;
 #if CONFIG_GEN_GC
-  int exhausted = (free_list == 0);
-  int full_gc_next_time = 0;
+  int exhausted = (free_list == 0 && bump_next == bump_end);
+#if CONFIG_COMPACT_CONS
+  int cons_exhausted = (cons_free_list == 0 &&
+                        cons_bump_next == cons_bump_end);
+#endif
+  int full_gc_next_time = 0, full;
   static int gc_counter;
+#else
+  int_ptr_t swept;
 #endif
-  int swept;
+  struct gc_log_rec rec;
+  ucnum freed = gc_stats.freed;
   mach_context_t mc;
+  struct timeval phase;
 
   assert (gc_enabled);
 
@@ -740,38 +2388,79 @@ void gc(void)
 #if CONFIG_GEN_GC
   if (malloc_bytes - prev_malloc_bytes >= opt_gc_delta)
     full_gc = 1;
+
+  if (full_gc && !inc_marking)
+    sweep_finish();
+
+  full = full_gc;
+  rec.kind = if3(inc_marking, "incremental", if3(full, "full", "minor"));
+  rec.mark_usec = if3(inc_marking, inc_mark_usec, 0);
+#else
+  rec.kind = "full";
+  rec.mark_usec = 0;
 #endif
 
+  gettimeofday(&phase, 0);
   save_context(mc);
   gc_enabled = 0;
   rcyc_empty();
-  mark(&mc, &gc_stack_top);
+#if CONFIG_GEN_GC
+  if (inc_marking)
+    inc_finish(&mc, &gc_stack_top);
+  else
+#endif
+    mark(&mc, &gc_stack_top);
   hash_process_weak();
   prepare_finals();
-  swept = sweep();
+  rec.mark_usec += gc_usec_since(&phase);
+
+  gettimeofday(&phase, 0);
 #if CONFIG_GEN_GC
-#if 0
-  printf("sweep: freed %d full_gc == %d exhausted == %d\n",
-         (int) swept, full_gc, exhausted);
+  sweep();
+#else
+  swept = sweep();
 #endif
-  if (++gc_counter >= FULL_GC_INTERVAL ||
-      freshobj_idx >= FRESHOBJ_VEC_SIZE)
-  {
+  rec.sweep_usec = gc_usec_since(&phase);
+  rec.freed = gc_stats.freed - freed;
+  rec.serial = ++gc_serial;
+  rec.pause_usec = -1;
+
+  gc_stats.mark_usec += rec.mark_usec;
+  gc_stats.sweep_usec += rec.sweep_usec;
+
+#if CONFIG_GEN_GC
+  if (full) {
+    gc_stats.full++;
+    sweep_log = rec;
+  } else {
+    gc_stats.minor++;
+  }
+
+  if (++gc_counter >= FULL_GC_INTERVAL) {
     full_gc_next_time = 1;
     gc_counter = 0;
   }
 
-  if (exhausted && full_gc && swept < 3 * HEAP_SIZE / 4)
-    more();
+  if (full) {
+    sweep_grow = exhausted;
+#if CONFIG_COMPACT_CONS
+    cons_sweep_grow = cons_exhausted;
+#endif
+  }
 #else
+  gc_stats.full++;
+
   if (swept < 3 * HEAP_SIZE / 4)
     more();
+#if CONFIG_COMPACT_CONS
+  if (cons_sweep_freed < 3 * CONS_HEAP_SIZE / 4)
+    more_conses();
+#endif
 #endif
 
 #if CONFIG_GEN_GC
   checkobj_idx = 0;
   mutobj_idx = 0;
-  freshobj_idx = 0;
   full_gc = full_gc_next_time;
 #endif
   call_finals();
@@ -779,6 +2468,29 @@ void gc(void)
   prev_malloc_bytes = malloc_bytes;
 
   inprogress--;
+
+  rec.pause_usec = gc_note_pause(start);
+
+#if CONFIG_GEN_GC
+  /* The record of a full collection is written out when the lazy sweep
+     is done; which might have happened already, during finalization. */
+  if (full) {
+    sweep_log.pause_usec = rec.pause_usec;
+    if (opt_gc_log && !sweep_pending())
+      gc_log(&sweep_log);
+    return;
+  }
+#endif
+
+  if (opt_gc_log)
+    gc_log(&rec);
+}
+
+void gc(void)
+{
+  struct timeval start;
+  gettimeofday(&start, 0);
+  gc_collect(&start);
 }
 
 int gc_state(int enabled)
@@ -800,6 +2512,10 @@ void gc_init(val *stack_bottom)
 
 void gc_mark(val obj)
 {
+  if (mark_cur) {
+    mark_grey(mark_cur, obj);
+    return;
+  }
   mark_obj(obj);
 }
 
@@ -818,15 +2534,40 @@ int gc_is_reachable(val obj)
   return is_ptr(obj) ? is_reachable(obj) : 1;
 }
 
+int gc_is_lazy_garbage(val obj)
+{
+  heap_t *heap;
+#if CONFIG_COMPACT_CONS
+  cons_heap_t *cheap;
+#endif
+
+#if CONFIG_GEN_GC
+  if (!sweep_pending())
+    return 0;
+#endif
+
+#if CONFIG_COMPACT_CONS
+  if ((cheap = in_cons_heap(obj)) != 0)
+    return is_lazy_garbage_cons(cheap, obj);
+#endif
+
+  heap = in_heap(obj);
+  return heap != 0 && is_lazy_garbage(heap, obj);
+}
+
 #if CONFIG_GEN_GC
 
 val gc_set(loc lo, val obj)
 {
   val *ptr = valptr(lo);
 
-  if (lo.obj && is_ptr(obj) && lo.obj->t.gen == 1 && obj->t.gen == 0 && !full_gc) {
+  if (inc_marking)
+    mark_grey(&inc_gray, obj);
+  else if (lo.obj && is_ptr(obj) && header(lo.obj)->t.gen == 1 &&
+           header(obj)->t.gen == 0 && !full_gc)
+  {
     if (checkobj_idx < CHECKOBJ_VEC_SIZE) {
-      obj->t.gen = -1;
+      header(obj)->t.gen = -1;
       checkobj[checkobj_idx++] = obj;
     } else if (gc_enabled) {
       gc();
@@ -844,14 +2585,26 @@ val gc_set(loc lo, val obj)
 
 val gc_mutated(val obj)
 {
+  val hdr = header(obj);
+
+  /* During incremental marking, a marked object must be scanned
+     again before the cycle is finished. */
+  if (inc_marking) {
+    if ((hdr->t.mark & (MARK_FULL | MARK_DIRTY)) == MARK_FULL) {
+      hdr->t.mark |= MARK_DIRTY;
+      mark_push(&inc_dirty, obj);
+    }
+    return obj;
+  }
+
   /* We care only about mature generation objects that have not
      already been noted. And if a full gc is coming, don't bother. */
-  if (full_gc || obj->t.gen <= 0)
+  if (full_gc || hdr->t.gen <= 0)
     return obj;
   /* Store in mutobj array *before* triggering gc, otherwise
      baby objects referenced by obj could be reclaimed! */
   if (mutobj_idx < MUTOBJ_VEC_SIZE) {
-    obj->t.gen = -1;
+    hdr->t.gen = -1;
     mutobj[mutobj_idx++] = obj;
   } else if (gc_enabled) {
     gc();
@@ -876,9 +2629,301 @@ static val gc_set_delta(val delta)
   return nil;
 }
 
-static val gc_wrap(void)
+static val gc_set_pause(val usec)
+{
+  val old = num(opt_gc_pause);
+  opt_gc_pause = if3(usec, c_num(usec), 0);
+  return old;
+}
+
+static val gc_get_max_pause(val reset)
+{
+  val ret = num(gc_max_pause);
+  if (default_null_arg(reset))
+    gc_max_pause = 0;
+  return ret;
+}
+
+static val gc_bytes_num(alloc_bytes_t bytes)
+{
+#if SIZEOF_ALLOC_BYTES_T > SIZEOF_PTR
+  if (bytes > (alloc_bytes_t) INT_PTR_MAX)
+    return logior(ash(unum(bytes >> 32), num_fast(32)),
+                  unum(bytes & 0xFFFFFFFF));
+#endif
+  return unum(bytes);
+}
+
+static val gc_get_stats(void)
+{
+  struct gc_stats st = gc_stats;
+  alloc_bytes_t gcb = gc_bytes, mlb = malloc_bytes;
+  cnum heaps = heap_count, max_pause = gc_max_pause;
+  val hist = vector(num_fast(GC_PAUSE_BUCKETS), zero);
+  args_decl(args, ARGS_MIN);
+  val stats = make_struct(gc_stats_s, nil, args);
+  int i;
+
+  for (i = 0; i < GC_PAUSE_BUCKETS; i++)
+    set(vecref_l(hist, num_fast(i)), unum(st.pause_hist[i]));
+
+  slotset(stats, minor_gcs_s, unum(st.minor));
+  slotset(stats, full_gcs_s, unum(st.full));
+  slotset(stats, inc_steps_s, unum(st.steps));
+  slotset(stats, mark_time_s, unum(st.mark_usec));
+  slotset(stats, sweep_time_s, unum(st.sweep_usec));
+  slotset(stats, freed_s, unum(st.freed));
+  slotset(stats, heaps_s, num(heaps));
+  slotset(stats, heap_grows_s, unum(st.grows));
+  slotset(stats, heap_releases_s, unum(st.releases));
+  slotset(stats, gc_bytes_s, gc_bytes_num(gcb));
+  slotset(stats, malloc_bytes_s, gc_bytes_num(mlb));
+  slotset(stats, pauses_s, unum(st.pauses));
+  slotset(stats, pause_time_s, unum(st.pause_usec));
+  slotset(stats, max_pause_s, num(max_pause));
+  slotset(stats, pause_hist_s, hist);
+
+  return stats;
+}
+
+static val gc_alloc_sample(val interval)
+{
+  val self = lit("alloc-sample");
+  val prev = num(alloc_sample_interval);
+  cnum n = if3(interval, c_num(interval), 0);
+
+  if (n < 0)
+    uw_throwf(error_s, lit("~a: interval ~s must not be negative"),
+              self, interval, nao);
+
+  alloc_sample_interval = alloc_sample_countdown = n;
+  return prev;
+}
+
+static int alloc_site_cmp(const void *lp, const void *rp)
+{
+  const struct alloc_site *ls = convert(const struct alloc_site *, lp);
+  const struct alloc_site *rs = convert(const struct alloc_site *, rp);
+  return (ls->samples < rs->samples) - (ls->samples > rs->samples);
+}
+
+static val alloc_site_name(val site)
+{
+  if (functionp(site)) {
+    val name = func_get_name(site, nil);
+    if (name)
+      return name;
+  }
+
+  return site;
+}
+
+static val gc_alloc_sites(val reset)
+{
+  struct alloc_site *sites = coerce(struct alloc_site *,
+                                    chk_malloc((alloc_sites_fill + 1) *
+                                               sizeof *sites));
+  cnum i, n = 0;
+  list_collect_decl (out, ptail);
+
+  for (i = 0; i < alloc_sites_size; i++)
+    if (alloc_sites[i].samples != 0)
+      sites[n++] = alloc_sites[i];
+
+  qsort(sites, n, sizeof *sites, alloc_site_cmp);
+
+  for (i = 0; i < n; i++)
+    ptail = list_collect(ptail, list(alloc_site_name(sites[i].site),
+                                     unum(sites[i].samples), nao));
+
+  free(sites);
+
+  if (default_null_arg(reset)) {
+    free(alloc_sites);
+    alloc_sites = 0;
+    alloc_sites_size = alloc_sites_fill = 0;
+  }
+
+  return out;
+}
+
+struct census_ent {
+  val sym;
+  ucnum count, bytes;
+};
+
+static ucnum payload_bytes(val obj)
+{
+  switch (convert(type_t, obj->t.type)) {
+  case STR:
+    if (obj->st.str && is_num(obj->st.alloc))
+      return c_num(obj->st.alloc) * sizeof (wchar_t);
+    return 0;
+  case VEC:
+    return (c_num(obj->v.vec[vec_alloc]) + 2) * sizeof (val);
+  case BGNUM:
+    return ALLOC(mp(obj)) * sizeof (mp_digit);
+  case BUF:
+    return if3(obj->b.size, c_num(obj->b.size), 0);
+  default:
+    return 0;
+  }
+}
+
+static int census_cmp(const void *lp, const void *rp)
+{
+  const struct census_ent *le = convert(const struct census_ent *, lp);
+  const struct census_ent *re = convert(const struct census_ent *, rp);
+  return (le->count < re->count) - (le->count > re->count);
+}
+
+/*
+ * The live objects are tallied by type, and COBJ objects by class, in C
+ * storage; the resulting list is only consed up once the walk through the
+ * heaps is over.
+ */
+static val heap_census(void)
+{
+  struct census_ent *ents = 0;
+  cnum nents = 0, tix[MAXTYPE + 1], i;
+  heap_t *heap;
+  int gc_save;
+  list_collect_decl (out, ptail);
+
+  for (i = 0; i <= MAXTYPE; i++)
+    tix[i] = -1;
+
+  for (heap = heap_list; heap != 0; heap = heap->next) {
+    obj_t *block, *end;
+
+#if HAVE_VALGRIND
+    if (opt_vg_debug)
+      VALGRIND_MAKE_MEM_DEFINED(&heap->block, sizeof heap->block);
+#endif
+
+    for (block = heap->block, end = heap->block + HEAP_SIZE;
+         block < end;
+         block++)
+    {
+      type_t t = convert(type_t, block->t.type);
+      cnum e;
+
+      if ((t & FREE) != 0 || is_lazy_garbage(heap, block))
+        continue;
+
+      if (t == COBJ) {
+        for (e = 0; e < nents; e++)
+          if (ents[e].sym == block->co.cls)
+            break;
+      } else {
+        e = tix[t];
+      }
+
+      if (e < 0 || e == nents) {
+        if (nents % 32 == 0)
+          ents = coerce(struct census_ent *,
+                        chk_realloc(coerce(mem_t *, ents),
+                                    (nents + 32) * sizeof *ents));
+        e = nents++;
+        ents[e].sym = typeof(block);
+        ents[e].count = ents[e].bytes = 0;
+        if (t != COBJ)
+          tix[t] = e;
+      }
+
+      ents[e].count++;
+      ents[e].bytes += payload_bytes(block);
+    }
+  }
+
+#if CONFIG_COMPACT_CONS
+  {
+    cons_heap_t *cheap;
+    ucnum conses = 0;
+
+    for (cheap = cons_heap_list; cheap != 0; cheap = cheap->next) {
+      struct cons_cell *cell, *end;
+
+      for (cell = cheap->block, end = cheap->block + CONS_HEAP_SIZE;
+           cell < end;
+           cell++)
+      {
+        val cons = cons_of_cell(cell);
+        if ((cons_header(cheap, cell)->t.type & FREE) == 0 &&
+            !is_lazy_garbage_cons(cheap, cons))
+          conses++;
+      }
+    }
+
+    if (conses != 0) {
+      if (tix[CONS] < 0) {
+        if (nents % 32 == 0)
+          ents = coerce(struct census_ent *,
+                        chk_realloc(coerce(mem_t *, ents),
+                                    (nents + 32) * sizeof *ents));
+        tix[CONS] = nents++;
+        ents[tix[CONS]].sym = cons_s;
+        ents[tix[CONS]].count = ents[tix[CONS]].bytes = 0;
+      }
+      ents[tix[CONS]].count += conses;
+    }
+  }
+#endif
+
+  qsort(ents, nents, sizeof *ents, census_cmp);
+
+  gc_save = gc_state(0);
+
+  for (i = 0; i < nents; i++)
+    ptail = list_collect(ptail, list(ents[i].sym, unum(ents[i].count),
+                                     unum(ents[i].bytes), nao));
+
+  gc_state(gc_save);
+  free(ents);
+  return out;
+}
+
+static val heap_census_report(val stream_in)
+{
+  val stream = default_arg(stream_in, std_output);
+  val census = heap_census();
+  val sites = gc_alloc_sites(nil);
+  val count = zero, bytes = zero;
+  val iter;
+
+  format(stream, lit("~<32a ~12a ~14a\n"),
+         lit("type"), lit("count"), lit("bytes"), nao);
+
+  for (iter = census; iter; iter = cdr(iter)) {
+    val ent = car(iter);
+    format(stream, lit("~<32s ~12a ~14a\n"),
+           first(ent), second(ent), third(ent), nao);
+    count = plus(count, second(ent));
+    bytes = plus(bytes, third(ent));
+  }
+
+  format(stream, lit("~<32a ~12a ~14a\n"), lit("total"), count, bytes, nao);
+
+  if (sites) {
+    format(stream, lit("\n~<32a ~12a\n"),
+           lit("allocation site"), lit("samples"), nao);
+
+    for (iter = sites; iter; iter = cdr(iter)) {
+      val ent = car(iter);
+      format(stream, lit("~<32s ~12a\n"), first(ent), second(ent), nao);
+    }
+  }
+
+  return nil;
+}
+
+static val gc_wrap(val full)
 {
   if (gc_enabled) {
+#if CONFIG_GEN_GC
+    if (default_null_arg(full))
+      full_gc = 1;
+#endif
     gc();
     return t;
   }
@@ -923,22 +2968,74 @@ val gc_call_finalizers(val obj)
 
 val valid_object_p(val obj)
 {
+  heap_t *heap;
+#if CONFIG_COMPACT_CONS
+  cons_heap_t *cheap;
+#endif
+
   if (!is_ptr(obj))
     return t;
 
-  if (!in_heap(obj))
+#if CONFIG_COMPACT_CONS
+  if ((cheap = in_cons_heap(obj)) != 0) {
+    if (header(obj)->t.type & (REACHABLE | FREE))
+      return nil;
+    return tnil(!is_lazy_garbage_cons(cheap, obj));
+  }
+#endif
+
+  if ((heap = in_heap(obj)) == 0)
     return nil;
 
   if (obj->t.type & (REACHABLE | FREE))
     return nil;
 
+  if (is_lazy_garbage(heap, obj))
+    return nil;
+
   return t;
 }
 
 void gc_late_init(void)
 {
-  reg_fun(intern(lit("gc"), system_package), func_n0(gc_wrap));
+  gc_stats_s = intern(lit("gc-stats"), user_package);
+  minor_gcs_s = intern(lit("minor-gcs"), user_package);
+  full_gcs_s = intern(lit("full-gcs"), user_package);
+  inc_steps_s = intern(lit("inc-steps"), user_package);
+  mark_time_s = intern(lit("mark-time"), user_package);
+  sweep_time_s = intern(lit("sweep-time"), user_package);
+  freed_s = intern(lit("freed"), user_package);
+  heaps_s = intern(lit("heaps"), user_package);
+  heap_grows_s = intern(lit("heap-grows"), user_package);
+  heap_releases_s = intern(lit("heap-releases"), user_package);
+  gc_bytes_s = intern(lit("gc-bytes"), user_package);
+  malloc_bytes_s = intern(lit("malloc-bytes"), user_package);
+  pauses_s = intern(lit("pauses"), user_package);
+  pause_time_s = intern(lit("pause-time"), user_package);
+  max_pause_s = intern(lit("max-pause"), user_package);
+  pause_hist_s = intern(lit("pause-hist"), user_package);
+
+  make_struct_type(gc_stats_s, nil, nil,
+                   list(minor_gcs_s, full_gcs_s, inc_steps_s, mark_time_s,
+                        sweep_time_s, freed_s, heaps_s, heap_grows_s,
+                        heap_releases_s, gc_bytes_s, malloc_bytes_s,
+                        pauses_s, pause_time_s, max_pause_s, pause_hist_s,
+                        nao),
+                   nil, nil, nil, nil);
+
+  reg_fun(intern(lit("gc"), system_package), func_n1o(gc_wrap, 0));
   reg_fun(intern(lit("gc-set-delta"), system_package), func_n1(gc_set_delta));
+  reg_fun(intern(lit("gc-set-pause"), system_package), func_n1(gc_set_pause));
+  reg_fun(intern(lit("gc-max-pause"), system_package),
+          func_n1o(gc_get_max_pause, 0));
+  reg_fun(gc_stats_s, func_n0(gc_get_stats));
+  reg_fun(intern(lit("alloc-sample"), system_package),
+          func_n1(gc_alloc_sample));
+  reg_fun(intern(lit("alloc-sites"), system_package),
+          func_n1o(gc_alloc_sites, 0));
+  reg_fun(intern(lit("heap-census"), system_package), func_n0(heap_census));
+  reg_fun(intern(lit("heap-census-report"), system_package),
+          func_n1o(heap_census_report, 0));
   reg_fun(intern(lit("finalize"), user_package), func_n3o(gc_finalize, 2));
   reg_fun(intern(lit("call-finalizers"), user_package),
           func_n1(gc_call_finalizers));
@@ -953,13 +3050,43 @@ void unmark(void)
 
   for (heap = heap_list; heap != 0; heap = heap->next) {
     val block, end;
+#if CONFIG_GEN_GC
+    /* The marks in a heap awaiting lazy sweeping tell the live
+       objects from the garbage; they must be kept. */
+    if (heap->unswept)
+      continue;
+#endif
     for (block = heap->block, end = heap->block + HEAP_SIZE;
          block < end;
          block++)
     {
       block->t.type = convert(type_t, block->t.type & ~REACHABLE);
+#if CONFIG_GEN_GC
+      block->t.mark = 0;
+#endif
+    }
+  }
+
+#if CONFIG_COMPACT_CONS
+  {
+    cons_heap_t *cheap;
+
+    for (cheap = cons_heap_list; cheap != 0; cheap = cheap->next) {
+      cnum i;
+#if CONFIG_GEN_GC
+      if (cheap->unswept)
+        continue;
+#endif
+      for (i = 0; i < convert(cnum, CONS_HEAP_SIZE); i++) {
+        val hdr = coerce(val, &cheap->hdr[i]);
+        hdr->t.type = convert(type_t, hdr->t.type & ~REACHABLE);
+#if CONFIG_GEN_GC
+        hdr->t.mark = 0;
+#endif
+      }
     }
   }
+#endif
 }
 
 void gc_cancel(void)
@@ -968,9 +3095,13 @@ void gc_cancel(void)
 #if CONFIG_GEN_GC
   checkobj_idx = 0;
   mutobj_idx = 0;
-  freshobj_idx = 0;
+  young_reset();
   full_gc = 1;
+  inc_marking = 0;
+  inc_gray.top = 0;
+  inc_dirty.top = 0;
 #endif
+  mark_cur = 0;
   inprogress = 0;
 }
 
@@ -1037,11 +3168,23 @@ void gc_free_all(void)
         finalize(block);
       }
 
-      free(iter);
+      heap_free(iter);
       iter = next;
     }
   }
 
+#if CONFIG_COMPACT_CONS
+  {
+    cons_heap_t *iter = cons_heap_list;
+
+    while (iter) {
+      cons_heap_t *next = iter->next;
+      cons_heap_free(iter);
+      iter = next;
+    }
+  }
+#endif
+
   {
     struct fin_reg *iter = final_list;
 
@@ -30,6 +30,7 @@ void gc_late_init(void);
 val prot1(val *loc);
 void protect(val *, ...);
 val make_obj(void);
+val make_cons_obj(void);
 void gc(void);
 int gc_state(int);
 int gc_inprogress(void);
@@ -37,6 +38,7 @@ void gc_mark(val);
 void gc_conservative_mark(val);
 void gc_mark_mem(val *low, val *high);
 int gc_is_reachable(val);
+int gc_is_lazy_garbage(val);
 val gc_finalize(val obj, val fun, val rev_order_p);
 val gc_call_finalizers(val obj);
 
@@ -56,6 +58,7 @@ void gc_report_copies(val *pvar);
 void gc_free_all(void);
 
 extern int gc_enabled;
+extern ucnum gc_serial;
 extern val **gc_prot_top;
 
 #if CONFIG_EXTRA_DEBUGGING
@@ -62,11 +62,31 @@ struct hash_ops {
   val (*equal_fun)(val, val);
   val (*assoc_fun)(val key, cnum hash, val list);
   val (*acons_new_c_fun)(val key, cnum hash, loc new_p, loc list);
+  int open;
 };
 
-#define hash_ops_init(hash, equal, assoc, acons) \
-  { hash, equal, assoc, acons }
+#define hash_ops_init(hash, equal, assoc, acons, open) \
+  { hash, equal, assoc, acons, open }
 
+/*
+ * A hash table is either chained or open. A chained table is a vector
+ * of lists of entries. An open table (used for eql-based hashes) is a
+ * vector of slot pairs: the hash code as a fixnum, followed by the entry
+ * itself, nil if the slot is empty, or t if the entry was deleted.
+ * Collisions are resolved by linear probing; deleted slots are reused
+ * by insertion and purged when the table is rebuilt. In both cases,
+ * modulus is the number of buckets or slots.
+ *
+ * While a table is being resized, the previous vector is retained as
+ * old_table, and its buckets or slots from old_next onward still hold
+ * entries which have yet to be moved; see hash_migrate.
+ *
+ * The vectors which a weak table discards while it is being iterated are
+ * kept in the retired array until the iteration is over, rather than
+ * by the iterators; see hash_iter_mark. The dirty array of a weak table
+ * records the buckets or slots which have received entries since the
+ * collection numbered dirty_serial; see hash_dirty.
+ */
 struct hash {
   ucnum seed;
   hash_flags_t flags;
@@ -74,18 +94,35 @@ struct hash {
   val table;
   cnum modulus;
   cnum count;
+  cnum tombs;
+  val old_table;
+  cnum old_modulus;
+  cnum old_next;
   val userdata;
   int usecount;
+  int listed;
   struct hash_ops *hops;
+  val *retired;
+  cnum nretired;
+  cnum *dirty;
+  cnum ndirty, dirty_size;
+  ucnum dirty_serial;
 };
 
 struct hash_iter {
   struct hash_iter *next;
+  int listed;
   val hash;
   cnum chain;
   val cons;
+  val table;
+  val old;
 };
 
+#define HASH_CHAIN_MOD 256
+#define HASH_OPEN_MOD 64
+#define HASH_MIGRATE_STEP 32
+
 #define hash_seed (deref(lookup_var_l(nil, hash_seed_s)))
 
 static_forward(struct hash_ops hash_eql_ops);
@@ -97,7 +134,7 @@ val hash_seed_s;
 /*
  * Dynamic lists built up during gc.
  */
-static struct hash *reachable_weak_hashes;
+static struct hash *reachable_hashes;
 static struct hash_iter *reachable_iters;
 
 static int hash_str_limit = INT_MAX, hash_rec_limit = 32;
@@ -107,33 +144,52 @@ static int hash_str_limit = INT_MAX, hash_rec_limit = 32;
 loc gethash_l(val hash, val key, loc new_p);
 #endif
 
-static u32_t randbox[] = {
-  0x49848f1bU, 0xe6255dbaU, 0x36da5bdcU, 0x47bf94e9U,
-  0x8cbcce22U, 0x559fc06aU, 0xd268f536U, 0xe10af79aU,
-  0xc1af4d69U, 0x1d2917b5U, 0xec4c304dU, 0x9ee5016cU,
-  0x69232f74U, 0xfead7bb3U, 0xe9089ab6U, 0xf012f6aeU,
-};
+/*
+ * Murmur3-style mixing of 32 bit words. Each word is scrambled on its
+ * own before it meets the accumulator, so the only serial dependency is
+ * the short rotate and multiply-add chain through acc; taking two words
+ * per step lets the scrambling of the second overlap with the first.
+ */
+#define hash_rotl(x, n) ((x) << (n) | (x) >> (32 - (n)))
+
+static u32_t hash_mix(u32_t k)
+{
+  k *= 0xcc9e2d51U;
+  k = hash_rotl(k, 15);
+  return k * 0x1b873593U;
+}
+
+#define hash_step(acc, in)                      \
+  ((acc) ^= hash_mix(in),                       \
+   (acc) = hash_rotl(acc, 13) * 5 + 0xe6546b64U)
+
+#define hash_step2(acc, in0, in1)               \
+  ((acc) ^= hash_mix(in0),                      \
+   (acc) = hash_rotl(acc, 13),                  \
+   (acc) ^= hash_mix(in1),                      \
+   (acc) = hash_rotl(acc, 13) * 5 + 0xe6546b64U)
+
+#define hash_finish(acc, len)                   \
+  ((acc) ^= (len),                              \
+   (acc) ^= (acc) >> 16,                        \
+   (acc) *= 0x85ebca6bU,                        \
+   (acc) ^= (acc) >> 13,                        \
+   (acc) *= 0xc2b2ae35U,                        \
+   (acc) ^= (acc) >> 16)
 
 static u32_t hash_c_str(const wchar_t *str, u32_t seed)
 {
+  const wchar_t *start = str;
   int count = hash_str_limit;
   u32_t acc = seed;
-  u32_t ch;
 
-  while (count-- && (ch = *str++) != 0) {
-    acc ^= ch;
-    acc ^= randbox[acc & 0xf];
-    acc = acc >> 1 | acc << (32 - 1);
-  }
+  for (; count >= 2 && str[0] && str[1]; count -= 2, str += 2)
+    hash_step2(acc, convert(u32_t, str[0]), convert(u32_t, str[1]));
 
-  acc ^= randbox[acc & 0xf];
-  acc = acc >> 1 | acc << (32 - 1);
-  acc ^= randbox[acc & 0xf];
-  acc = acc >> 1 | acc << (32 - 1);
-  acc ^= randbox[acc & 0xf];
-  acc = acc >> 1 | acc << (32 - 1);
-  acc ^= randbox[acc & 0xf];
+  if (count > 0 && str[0])
+    hash_step(acc, convert(u32_t, *str++));
 
+  hash_finish(acc, convert(u32_t, str - start));
   return acc;
 }
 
@@ -142,16 +198,19 @@ static u32_t hash_buf(const mem_t *ptr, ucnum size, u32_t seed)
   const u32_t *buf = coerce(const u32_t *, ptr);
   int count = hash_str_limit;
   u32_t acc = seed;
+  u32_t len = size;
 
-  for (; size >= sizeof *buf && count--; size -= sizeof *buf, buf++) {
-    u32_t in = *buf;
-    acc ^= in;
-    acc ^= randbox[acc & 0xf];
-    acc = acc >> 1 | acc << (32 - 1);
+  for (; size >= 2 * sizeof *buf && count >= 2;
+       size -= 2 * sizeof *buf, count -= 2, buf += 2)
+    hash_step2(acc, buf[0], buf[1]);
+
+  if (size >= sizeof *buf && count > 0) {
+    hash_step(acc, *buf++);
+    size -= sizeof *buf;
   }
 
-  if (size != 0) {
-    const mem_t *tail = coerce(const mem_t *, ptr);
+  if (size != 0 && size < sizeof *buf) {
+    const mem_t *tail = coerce(const mem_t *, buf);
     u32_t in = 0;
 
     switch (size) {
@@ -163,19 +222,10 @@ static u32_t hash_buf(const mem_t *ptr, ucnum size, u32_t seed)
       in |= convert(u32_t, tail[0]);
     }
 
-    acc ^= in;
-    acc ^= randbox[acc & 0xf];
-    acc = acc >> 1 | acc << (32 - 1);
+    hash_step(acc, in);
   }
 
-  acc ^= randbox[acc & 0xf];
-  acc = acc >> 1 | acc << (32 - 1);
-  acc ^= randbox[acc & 0xf];
-  acc = acc >> 1 | acc << (32 - 1);
-  acc ^= randbox[acc & 0xf];
-  acc = acc >> 1 | acc << (32 - 1);
-  acc ^= randbox[acc & 0xf];
-
+  hash_finish(acc, len);
   return acc;
 }
 
@@ -207,6 +257,13 @@ ucnum equal_hash(val obj, int *count, ucnum seed)
     return equal_hash(obj->c.car, count, seed)
             + 2 * equal_hash(obj->c.cdr, count, seed);
   case STR:
+#if STR_HASH_CACHE
+    if (seed == 0 && hash_str_limit == INT_MAX) {
+      if (obj->st.hash == 0)
+        obj->st.hash = hash_c_str(obj->st.str, 0);
+      return obj->st.hash;
+    }
+#endif
     return hash_c_str(obj->st.str, seed);
   case CHR:
     return c_chr(obj);
@@ -247,7 +304,7 @@ ucnum equal_hash(val obj, int *count, ucnum seed)
   case BGNUM:
     return mp_hash(mp(obj));
   case FLNUM:
-    return hash_double(obj->fl.n);
+    return hash_double(c_flo(obj));
   case COBJ:
   case CPTR:
     if (obj->co.ops->equalsub) {
@@ -276,10 +333,14 @@ static ucnum eql_hash(val obj, int *count)
     case BGNUM:
       return mp_hash(mp(obj));
     case FLNUM:
-      return hash_double(obj->fl.n);
+      return hash_double(c_flo(obj));
     case RNG:
       return eql_hash(obj->rn.from, count) + 2 * eql_hash(obj->rn.to, count);
     default:
+#if CONFIG_COMPACT_CONS
+      if (is_compact_cons(obj))
+        return coerce(ucnum, obj) / (2 * CONS_BIAS);
+#endif
       switch (sizeof (mem_t *)) {
       case 4:
         return coerce(ucnum, obj) >> 4;
@@ -519,6 +580,49 @@ static void hash_print_op(val hash, val out, val pretty, struct strm_ctx *ctx)
   set_indent(out, save_indent);
 }
 
+/*
+ * The modulus of a vector of the table, which need not be its current
+ * one; its length field is accessed directly, since it may be marked.
+ */
+static cnum hash_vec_modulus(struct hash *h, val table)
+{
+  cnum len = c_num(table->v.vec[vec_length]);
+  return h->hops->open ? len / 2 : len;
+}
+
+/*
+ * The table, its chains and entries may already have been marked when
+ * they are reached here, through some other reference; the type field of
+ * a marked object cannot be trusted by the checked accessors, so the
+ * fields are accessed directly.
+ *
+ * Only a weak-values table has anything to mark here: its keys. The
+ * entries of a weak-keys table are ephemerons, whose values are marked
+ * by hash_process_weak once their keys are found to be reachable.
+ */
+static void hash_mark_weak(struct hash *h, val table, cnum modulus)
+{
+  cnum i;
+
+  if (h->flags != hash_weak_vals)
+    return;
+
+  if (h->hops->open) {
+    for (i = 0; i < modulus; i++) {
+      val entry = table->v.vec[2 * i + 1];
+      if (entry && entry != t)
+        gc_mark(entry->c.car);
+    }
+  } else {
+    for (i = 0; i < modulus; i++) {
+      val iter;
+
+      for (iter = table->v.vec[i]; iter != nil; iter = iter->c.cdr)
+        gc_mark(iter->c.car->c.car);
+    }
+  }
+}
+
 static void hash_mark(val hash)
 {
   struct hash *h = coerce(struct hash *, hash->co.handle);
@@ -526,89 +630,353 @@ static void hash_mark(val hash)
 
   gc_mark(h->userdata);
 
-  /* Use counts will be re-calculated by a scan of the
-     hash iterators which are still reachable. */
-  h->usecount = 0;
+  /* Use counts will be re-calculated after marking, by a scan of the
+     hash iterators which are still reachable. Under incremental
+     collection, a table may be visited more than once, and the
+     mutator runs in between; hence it is listed only once, and the
+     use count is not disturbed until then. */
+  if (!h->listed) {
+    h->listed = 1;
+    h->next = reachable_hashes;
+    reachable_hashes = h;
+  }
 
-  switch (h->flags) {
-  case hash_weak_none:
+  if (h->flags == hash_weak_none) {
     /* If the hash is not weak, we can simply mark the table
-       vector and we are done. */
+       vectors and we are done. */
     gc_mark(h->table);
-    break;
-  case hash_weak_keys:
-    /* Keys are weak: mark the values only. */
-    for (i = 0; i < h->modulus; i++) {
-      val ind = num_fast(i);
-      val chain = vecref(h->table, ind);
-      val iter;
-
-      for (iter = chain; iter != nil; iter = cdr(iter)) {
-        val entry = car(iter);
-        gc_mark(cdr(entry));
-      }
-    }
-    h->next = reachable_weak_hashes;
-    reachable_weak_hashes = h;
-    break;
-  case hash_weak_vals:
-    /* Values are weak: mark the keys only. */
+    gc_mark(h->old_table);
+    return;
+  }
 
-    for (i = 0; i < h->modulus; i++) {
-      val ind = num_fast(i);
-      val chain = vecref(h->table, ind);
-      val iter;
+  hash_mark_weak(h, h->table, h->modulus);
+  if (h->old_table)
+    hash_mark_weak(h, h->old_table, h->old_modulus);
+  for (i = 0; i < h->nretired; i++)
+    hash_mark_weak(h, h->retired[i], hash_vec_modulus(h, h->retired[i]));
+}
 
-      for (iter = chain; iter != nil; iter = cdr(iter)) {
-        val entry = car(iter);
-        gc_mark(car(entry));
-      }
-    }
-    h->next = reachable_weak_hashes;
-    reachable_weak_hashes = h;
-    break;
-  case hash_weak_both:
-    /* Values and keys are weak: don't mark anything. */
-    h->next = reachable_weak_hashes;
-    reachable_weak_hashes = h;
-    break;
-  }
+static void hash_destroy(val hash)
+{
+  struct hash *h = coerce(struct hash *, hash->co.handle);
+  free(h->retired);
+  free(h->dirty);
+  free(h);
 }
 
 static struct cobj_ops hash_ops = cobj_ops_init(hash_equal_op,
                                                 hash_print_op,
-                                                cobj_destroy_free_op,
+                                                hash_destroy,
                                                 hash_mark,
                                                 hash_hash_op);
 
-static void hash_grow(struct hash *h, val hash)
+/*
+ * Hash entries are conses which carry the hash code of the key in an
+ * extra field; hence they are always allocated as full-sized objects.
+ */
+static val hash_cons(val key, val value, cnum hash)
 {
-  cnum i;
-  cnum new_modulus = 2 * h->modulus;
-  val new_table;
+  val entry = make_obj();
+  entry->ch.type = CONS;
+  entry->ch.car = key;
+  entry->ch.cdr = value;
+  entry->ch.hash = hash;
+  return entry;
+}
 
-  if (new_modulus > NUM_MAX)
+static val hash_new_table(struct hash_ops *hops)
+{
+  if (hops->open)
+    return vector(num_fast(2 * HASH_OPEN_MOD), nil);
+  return vector(num_fast(HASH_CHAIN_MOD), nil);
+}
+
+static ucnum hash_open_mix(ucnum hv)
+{
+  hv ^= hv >> 16;
+  hv *= 0x45d9f3bU;
+  hv ^= hv >> 16;
+  return hv;
+}
+
+static cnum hash_open_index(struct hash *h, val table, cnum modulus,
+                            val key, ucnum hv)
+{
+  val *slot = table->v.vec;
+  ucnum mask = modulus - 1;
+  ucnum i = hash_open_mix(hv) & mask;
+  val hnum = num_fast(hv & NUM_MAX);
+  val (*equal_fun)(val, val) = h->hops->equal_fun;
+
+  for (;; i = (i + 1) & mask) {
+    val entry = slot[2 * i + 1];
+
+    if (!entry)
+      return -1;
+
+    if (slot[2 * i] == hnum && entry != t &&
+        (car(entry) == key || equal_fun(car(entry), key)))
+      return i;
+  }
+}
+
+static cnum hash_open_find(struct hash *h, val key, ucnum hv, val *ptable)
+{
+  cnum i = hash_open_index(h, h->table, h->modulus, key, hv);
+
+  if (i >= 0) {
+    *ptable = h->table;
+    return i;
+  }
+
+  if (h->old_table) {
+    i = hash_open_index(h, h->old_table, h->old_modulus, key, hv);
+    *ptable = h->old_table;
+  }
+
+  return i;
+}
+
+/*
+ * Note that bucket or slot i of a weak table has received an entry. A
+ * minor collection need only scan such places: every other entry was
+ * present at the previous collection, which either marked it together
+ * with its key and value, or found the table to be mature and untouched.
+ * Either way, those objects are all in the mature generation. When the
+ * places exceed an eighth of the table, or the table is replaced, the
+ * whole of it is to be scanned, which is indicated by an ndirty of -1.
+ */
+static void hash_dirty(struct hash *h, cnum i)
+{
+  if (h->flags == hash_weak_none)
+    return;
+
+  if (h->dirty_serial != gc_serial) {
+    h->dirty_serial = gc_serial;
+    h->ndirty = 0;
+  }
+
+  if (h->ndirty < 0)
+    return;
+
+  if (h->ndirty >= h->modulus / 8) {
+    h->ndirty = -1;
+    return;
+  }
+
+  if (h->ndirty >= h->dirty_size) {
+    cnum size = h->dirty_size ? 2 * h->dirty_size : 16;
+    h->dirty = coerce(cnum *, chk_realloc(coerce(mem_t *, h->dirty),
+                                          size * sizeof *h->dirty));
+    h->dirty_size = size;
+  }
+
+  h->dirty[h->ndirty++] = i;
+}
+
+static void hash_dirty_all(struct hash *h)
+{
+  h->dirty_serial = gc_serial;
+  h->ndirty = -1;
+}
+
+/*
+ * Keep a vector which a weak table is discarding, for the iterators
+ * which may still be traversing it.
+ */
+static void hash_retire(struct hash *h, val hash, val table)
+{
+  if (!table || h->flags == hash_weak_none)
     return;
 
-  new_table = vector(num_fast(new_modulus), nil);
+  h->retired = coerce(val *, chk_realloc(coerce(mem_t *, h->retired),
+                                         (h->nretired + 1) *
+                                         sizeof *h->retired));
+  h->retired[h->nretired++] = table;
+  mut(hash);
+}
+
+static void hash_release_retired(struct hash *h)
+{
+  free(h->retired);
+  h->retired = 0;
+  h->nretired = 0;
+}
+
+static void hash_open_put(struct hash *h, val entry, ucnum hv)
+{
+  val table = h->table;
+  val *slot = table->v.vec;
+  ucnum mask = h->modulus - 1;
+  ucnum i = hash_open_mix(hv) & mask;
+
+  for (;; i = (i + 1) & mask) {
+    val old = slot[2 * i + 1];
+
+    if (!old || old == t) {
+      if (old)
+        h->tombs--;
+      slot[2 * i] = num_fast(hv & NUM_MAX);
+      set(mkloc(slot[2 * i + 1], table), entry);
+      hash_dirty(h, i);
+      return;
+    }
+  }
+}
+
+static cnum hash_open_size(struct hash *h)
+{
+  cnum new_modulus = h->modulus;
+
+  while ((h->count + 1) * 2 > new_modulus) {
+    if (new_modulus > NUM_MAX / 4)
+      uw_throwf(error_s, lit("hash table overflow"), nao);
+    new_modulus *= 2;
+  }
+
+  return new_modulus;
+}
 
-  for (i = 0; i < h->modulus; i++) {
-    val conses = vecref(h->table, num_fast(i));
+/*
+ * Move up to limit buckets or slots of the old table into the current
+ * one. This is done a few at a time by the operations which modify the
+ * table, so that the cost of resizing is spread over them.
+ */
+static void hash_migrate(struct hash *h, cnum limit)
+{
+  val old_table = h->old_table;
+  cnum i = h->old_next;
+  cnum end = h->old_modulus - i > limit ? i + limit : h->old_modulus;
+
+  if (h->hops->open) {
+    for (; i < end; i++) {
+      val entry = old_table->v.vec[2 * i + 1];
+      if (entry && entry != t) {
+        hash_open_put(h, entry, entry->ch.hash);
+        old_table->v.vec[2 * i + 1] = t;
+      }
+    }
+  } else {
+    for (; i < end; i++) {
+      loc pold = vecref_l(old_table, num_fast(i));
+      val conses = deref(pold);
+
+      while (conses) {
+        val entry = car(conses);
+        val next = cdr(conses);
+        cnum j = entry->ch.hash % h->modulus;
+        loc pchain = vecref_l(h->table, num_fast(j));
+        set(cdr_l(conses), deref(pchain));
+        set(pchain, conses);
+        hash_dirty(h, j);
+        conses = next;
+      }
 
-    while (conses) {
-      val entry = car(conses);
-      val next = cdr(conses);
-      loc pchain = vecref_l(new_table,
-                            num_fast(entry->ch.hash % new_modulus));
-      set(cdr_l(conses), deref(pchain));
-      set(pchain, conses);
-      conses = next;
+      set(pold, nil);
     }
   }
 
+  h->old_next = i;
+
+  if (i == h->old_modulus)
+    h->old_table = nil;
+}
+
+static void hash_resize(struct hash *h, val hash, cnum new_modulus)
+{
+  val new_table = vector(num_fast(h->hops->open
+                                  ? 2 * new_modulus
+                                  : new_modulus), nil);
+
+  if (h->old_table)
+    hash_migrate(h, h->old_modulus);
+
+  set(mkloc(h->old_table, hash), h->table);
+  h->old_modulus = h->modulus;
+  h->old_next = 0;
+
+  set(mkloc(h->table, hash), new_table);
   h->modulus = new_modulus;
-  h->table = new_table;
+  h->tombs = 0;
+  hash_dirty_all(h);
+}
+
+/*
+ * Rebuild an open table at once, from both of its tables, leaving
+ * the vectors intact for any iterators which are traversing them.
+ */
+static void hash_open_rebuild(struct hash *h, val hash)
+{
+  val table = h->table, old_table = h->old_table;
+  cnum modulus = h->modulus, old_modulus = h->old_modulus, i;
+  cnum new_modulus = hash_open_size(h);
+  val new_table = vector(num_fast(2 * new_modulus), nil);
+
+  hash_retire(h, hash, table);
+  hash_retire(h, hash, old_table);
+
   set(mkloc(h->table, hash), new_table);
+  h->modulus = new_modulus;
+  h->tombs = 0;
+  h->old_table = nil;
+  hash_dirty_all(h);
+
+  for (i = 0; i < modulus; i++) {
+    val entry = table->v.vec[2 * i + 1];
+    if (entry && entry != t)
+      hash_open_put(h, entry, entry->ch.hash);
+  }
+
+  for (i = 0; old_table && i < old_modulus; i++) {
+    val entry = old_table->v.vec[2 * i + 1];
+    if (entry && entry != t)
+      hash_open_put(h, entry, entry->ch.hash);
+  }
+}
+
+static val hash_open_acons_new_c(struct hash *h, val hash, val key,
+                                 ucnum hv, loc new_p)
+{
+  val table;
+  cnum i = hash_open_find(h, key, hv, &table);
+  cnum load;
+  val entry;
+
+  if (i >= 0) {
+    if (!nullocp(new_p))
+      deref(new_p) = nil;
+    return table->v.vec[2 * i + 1];
+  }
+
+  entry = hash_cons(key, nil, hv);
+  load = h->count + h->tombs + 1;
+
+  /* While iterators are active, resizing is deferred as long
+     as there is room; iterators that are present during a rebuild
+     continue to traverse the tables they started on. */
+  if (load * 8 > h->modulus * 6) {
+    if (h->usecount == 0)
+      hash_resize(h, hash, hash_open_size(h));
+    else if (load * 8 > h->modulus * 7)
+      hash_open_rebuild(h, hash);
+  }
+
+  hash_open_put(h, entry, hv);
+  h->count++;
+
+  if (!nullocp(new_p))
+    deref(new_p) = t;
+  return entry;
+}
+
+static void hash_grow(struct hash *h, val hash)
+{
+  cnum new_modulus = 2 * h->modulus;
+
+  if (new_modulus > NUM_MAX)
+    return;
+
+  hash_resize(h, hash, new_modulus);
 }
 
 static val hash_assoc(val key, cnum hash, val list)
@@ -644,8 +1012,7 @@ static val hash_acons_new_c(val key, cnum hash, loc new_p, loc list)
       deref(new_p) = nil;
     return existing;
   } else {
-    val nc = cons(key, nil);
-    nc->ch.hash = hash;
+    val nc = hash_cons(key, nil, hash);
     set(list, cons(nc, deref(list)));
     if (!nullocp(new_p))
       deref(new_p) = t;
@@ -662,8 +1029,7 @@ static val hash_aconsql_new_c(val key, cnum hash, loc new_p, loc list)
       deref(new_p) = nil;
     return existing;
   } else {
-    val nc = cons(key, nil);
-    nc->ch.hash = hash;
+    val nc = hash_cons(key, nil, hash);
     set(list, cons(nc, deref(list)));
     if (!nullocp(new_p))
       deref(new_p) = t;
@@ -673,11 +1039,13 @@ static val hash_aconsql_new_c(val key, cnum hash, loc new_p, loc list)
 
 static_def(struct hash_ops hash_eql_ops = hash_ops_init(eql_hash_op, eql,
                                                         hash_assql,
-                                                        hash_aconsql_new_c));
+                                                        hash_aconsql_new_c,
+                                                        1));
 
 static_def(struct hash_ops hash_equal_ops = hash_ops_init(equal_hash, equal,
                                                           hash_assoc,
-                                                          hash_acons_new_c));
+                                                          hash_acons_new_c,
+                                                          0));
 
 val make_seeded_hash(val weak_keys, val weak_vals, val equal_based, val seed)
 {
@@ -688,21 +1056,30 @@ val make_seeded_hash(val weak_keys, val weak_vals, val equal_based, val seed)
   } else {
     int flags = ((weak_vals != nil) << 1) | (weak_keys != nil);
     struct hash *h = coerce(struct hash *, chk_malloc(sizeof *h));
-    val mod = num_fast(256);
-    val table = vector(mod, nil);
+    struct hash_ops *hops = equal_based ? &hash_equal_ops : &hash_eql_ops;
+    val table = hash_new_table(hops);
     val hash = cobj(coerce(mem_t *, h), hash_s, &hash_ops);
 
     h->seed = convert(u32_t, c_unum(default_arg(seed,
                                                 if3(hash_seed_s,
                                                     hash_seed, zero))));
     h->flags = convert(hash_flags_t, flags);
-    h->modulus = c_num(mod);
+    h->modulus = hops->open ? HASH_OPEN_MOD : HASH_CHAIN_MOD;
     h->count = 0;
+    h->tombs = 0;
     h->table = table;
+    h->old_table = nil;
+    h->old_modulus = h->old_next = 0;
     h->userdata = nil;
 
     h->usecount = 0;
-    h->hops = equal_based ? &hash_equal_ops : &hash_eql_ops;
+    h->listed = 0;
+    h->hops = hops;
+    h->retired = 0;
+    h->nretired = 0;
+    h->dirty = 0;
+    h->dirty_size = 0;
+    hash_dirty_all(h);
 
     return hash;
   }
@@ -717,19 +1094,27 @@ val make_similar_hash(val existing)
 {
   struct hash *ex = coerce(struct hash *, cobj_handle(existing, hash_s));
   struct hash *h = coerce(struct hash *, chk_malloc(sizeof *h));
-  val mod = num_fast(256);
-  val table = vector(mod, nil);
+  val table = hash_new_table(ex->hops);
   val hash = cobj(coerce(mem_t *, h), hash_s, &hash_ops);
 
-  h->modulus = c_num(mod);
+  h->modulus = ex->hops->open ? HASH_OPEN_MOD : HASH_CHAIN_MOD;
   h->count = 0;
+  h->tombs = 0;
   h->table = table;
+  h->old_table = nil;
+  h->old_modulus = h->old_next = 0;
   h->userdata = ex->userdata;
 
   h->seed = ex->seed;
   h->flags = ex->flags;
   h->usecount = 0;
+  h->listed = 0;
   h->hops = ex->hops;
+  h->retired = 0;
+  h->nretired = 0;
+  h->dirty = 0;
+  h->dirty_size = 0;
+  hash_dirty_all(h);
 
   return hash;
 }
@@ -740,34 +1125,68 @@ static val copy_hash_chain(val chain)
 
   for (; chain; chain = cdr(chain)) {
     val entry = car(chain);
-    val nentry = cons(car(entry), cdr(entry));
-    nentry->ch.hash = entry->ch.hash;
+    val nentry = hash_cons(car(entry), cdr(entry), entry->ch.hash);
     ptail = list_collect(ptail, nentry);
   }
 
   return out;
 }
 
+static val copy_hash_table(struct hash *ex, val table, cnum modulus)
+{
+  val copy = vector(length_vec(table), nil);
+  cnum i;
+
+  if (ex->hops->open) {
+    for (i = 0; i < modulus; i++) {
+      val entry = table->v.vec[2 * i + 1];
+
+      copy->v.vec[2 * i] = table->v.vec[2 * i];
+
+      if (entry && entry != t) {
+        entry = hash_cons(car(entry), cdr(entry), entry->ch.hash);
+      }
+
+      set(mkloc(copy->v.vec[2 * i + 1], copy), entry);
+    }
+  } else {
+    for (i = 0; i < modulus; i++) {
+      val ind = num_fast(i);
+      set(vecref_l(copy, ind), copy_hash_chain(vecref(table, ind)));
+    }
+  }
+
+  return copy;
+}
+
 val copy_hash(val existing)
 {
   struct hash *ex = coerce(struct hash *, cobj_handle(existing, hash_s));
+  val table = copy_hash_table(ex, ex->table, ex->modulus);
+  val old_table = if2(ex->old_table,
+                      copy_hash_table(ex, ex->old_table, ex->old_modulus));
   struct hash *h = coerce(struct hash *, chk_malloc(sizeof *h));
-  val mod = num_fast(ex->modulus);
-  val table = vector(mod, nil);
   val hash = cobj(coerce(mem_t *, h), hash_s, &hash_ops);
-  val iter;
 
   h->modulus = ex->modulus;
   h->count = ex->count;
+  h->tombs = ex->tombs;
   h->table = table;
+  h->old_table = old_table;
+  h->old_modulus = ex->old_modulus;
+  h->old_next = ex->old_next;
   h->userdata = ex->userdata;
 
+  h->seed = ex->seed;
   h->flags = ex->flags;
   h->usecount = 0;
+  h->listed = 0;
   h->hops = ex->hops;
-
-  for (iter = zero; lt(iter, mod); iter = plus(iter, one))
-    set(vecref_l(h->table, iter), copy_hash_chain(vecref(ex->table, iter)));
+  h->retired = 0;
+  h->nretired = 0;
+  h->dirty = 0;
+  h->dirty_size = 0;
+  hash_dirty_all(h);
 
   return hash;
 }
@@ -777,12 +1196,35 @@ val gethash_c(val hash, val key, loc new_p)
   struct hash *h = coerce(struct hash *, cobj_handle(hash, hash_s));
   int lim = hash_rec_limit;
   cnum hv = h->hops->hash_fun(key, &lim, h->seed);
-  loc pchain = vecref_l(h->table, num_fast(hv % h->modulus));
-  val old = deref(pchain);
-  val cell = h->hops->acons_new_c_fun(key, hv, new_p, pchain);
-  if (old != deref(pchain) && ++h->count > 2 * h->modulus && h->usecount == 0)
-    hash_grow(h, hash);
-  return cell;
+
+  if (h->old_table && h->usecount == 0)
+    hash_migrate(h, HASH_MIGRATE_STEP);
+
+  if (h->hops->open) {
+    return hash_open_acons_new_c(h, hash, key, hv, new_p);
+  } else {
+    loc pchain;
+    val old, cell;
+
+    if (h->old_table) {
+      val chain = vecref(h->old_table, num_fast(hv % h->old_modulus));
+      if ((cell = h->hops->assoc_fun(key, hv, chain)) != nil) {
+        if (!nullocp(new_p))
+          deref(new_p) = nil;
+        return cell;
+      }
+    }
+
+    pchain = vecref_l(h->table, num_fast(hv % h->modulus));
+    old = deref(pchain);
+    cell = h->hops->acons_new_c_fun(key, hv, new_p, pchain);
+    if (old != deref(pchain)) {
+      hash_dirty(h, hv % h->modulus);
+      if (++h->count > 2 * h->modulus && h->usecount == 0)
+        hash_grow(h, hash);
+    }
+    return cell;
+  }
 }
 
 val gethash_e(val hash, val key)
@@ -790,8 +1232,22 @@ val gethash_e(val hash, val key)
   struct hash *h = coerce(struct hash *, cobj_handle(hash, hash_s));
   int lim = hash_rec_limit;
   cnum hv = h->hops->hash_fun(key, &lim, h->seed);
-  val chain = vecref(h->table, num_fast(hv % h->modulus));
-  return h->hops->assoc_fun(key, hv, chain);
+
+  if (h->hops->open) {
+    val table;
+    cnum i = hash_open_find(h, key, hv, &table);
+    return if2(i >= 0, table->v.vec[2 * i + 1]);
+  } else {
+    val chain = vecref(h->table, num_fast(hv % h->modulus));
+    val cell = h->hops->assoc_fun(key, hv, chain);
+
+    if (!cell && h->old_table) {
+      chain = vecref(h->old_table, num_fast(hv % h->old_modulus));
+      cell = h->hops->assoc_fun(key, hv, chain);
+    }
+
+    return cell;
+  }
 }
 
 val gethash(val hash, val key)
@@ -842,12 +1298,10 @@ val pushhash(val hash, val key, val value)
   return new_p;
 }
 
-val remhash(val hash, val key)
+static val hash_chain_remove(struct hash *h, val table, cnum modulus,
+                             val key, cnum hv)
 {
-  struct hash *h = coerce(struct hash *, cobj_handle(hash, hash_s));
-  int lim = hash_rec_limit;
-  cnum hv = h->hops->hash_fun(key, &lim, h->seed);
-  val *pchain = valptr(vecref_l(h->table, num_fast(hv % h->modulus)));
+  val *pchain = valptr(vecref_l(table, num_fast(hv % modulus)));
   val existing = h->hops->assoc_fun(key, hv, *pchain);
 
   if (existing) {
@@ -857,23 +1311,63 @@ val remhash(val hash, val key)
         break;
       }
     }
-    h->count--;
-    bug_unless (h->count >= 0);
-    return cdr(existing);
   }
 
-  return nil;
+  return existing;
+}
+
+val remhash(val hash, val key)
+{
+  struct hash *h = coerce(struct hash *, cobj_handle(hash, hash_s));
+  int lim = hash_rec_limit;
+  cnum hv = h->hops->hash_fun(key, &lim, h->seed);
+  val existing;
+
+  if (h->old_table && h->usecount == 0)
+    hash_migrate(h, HASH_MIGRATE_STEP);
+
+  if (h->hops->open) {
+    val table;
+    cnum i = hash_open_find(h, key, hv, &table);
+
+    if (i < 0)
+      return nil;
+
+    existing = table->v.vec[2 * i + 1];
+    table->v.vec[2 * i + 1] = t;
+    if (table == h->table)
+      h->tombs++;
+  } else {
+    existing = hash_chain_remove(h, h->table, h->modulus, key, hv);
+
+    if (!existing && h->old_table)
+      existing = hash_chain_remove(h, h->old_table, h->old_modulus, key, hv);
+
+    if (!existing)
+      return nil;
+  }
+
+  h->count--;
+  bug_unless (h->count >= 0);
+  return cdr(existing);
 }
 
 val clearhash(val hash)
 {
   struct hash *h = coerce(struct hash *, cobj_handle(hash, hash_s));
-  val mod = num_fast(256);
-  val table = vector(mod, nil);
+  val table = hash_new_table(h->hops);
   cnum oldcount = h->count;
-  h->modulus = c_num(mod);
+  if (h->usecount > 0) {
+    hash_retire(h, hash, h->table);
+    hash_retire(h, hash, h->old_table);
+  }
+  h->modulus = h->hops->open ? HASH_OPEN_MOD : HASH_CHAIN_MOD;
   h->count = 0;
-  h->table = table;
+  h->tombs = 0;
+  h->old_table = nil;
+  h->old_modulus = h->old_next = 0;
+  set(mkloc(h->table, hash), table);
+  hash_dirty_all(h);
   return oldcount ? num(oldcount) : nil;
 }
 
@@ -902,14 +1396,29 @@ val hashp(val obj)
   return typeof(obj) == hash_s ? t : nil;
 }
 
+/*
+ * The vectors of a weak table are not marked through its iterators,
+ * which would hold all of the entries; the table itself keeps them, as
+ * its current vectors or retired ones, and they are marked once the
+ * dead entries have been removed from them.
+ */
 static void hash_iter_mark(val hash_iter)
 {
   struct hash_iter *hi = coerce(struct hash_iter *, hash_iter->co.handle);
+  struct hash *h = if3(hi->hash,
+                       coerce(struct hash *, hi->hash->co.handle), 0);
   if (hi->hash)
     gc_mark(hi->hash);
   gc_mark(hi->cons);
-  hi->next = reachable_iters;
-  reachable_iters = hi;
+  if (!h || h->flags == hash_weak_none) {
+    gc_mark(hi->table);
+    gc_mark(hi->old);
+  }
+  if (!hi->listed) {
+    hi->listed = 1;
+    hi->next = reachable_iters;
+    reachable_iters = hi;
+  }
 }
 
 static struct cobj_ops hash_iter_ops = cobj_ops_init(eq,
@@ -925,15 +1434,39 @@ val hash_begin(val hash)
   struct hash_iter *hi = coerce(struct hash_iter *, chk_malloc(sizeof *hi));
 
   hi->next = 0;
+  hi->listed = 0;
   hi->hash = nil;
   hi->chain = -1;
   hi->cons = nil;
+  hi->table = nil;
+  hi->old = nil;
   hi_obj = cobj(coerce(mem_t *, hi), hash_iter_s, &hash_iter_ops);
   hi->hash = hash;
+  if (h->hops->open)
+    hi->table = h->table;
+  hi->old = h->old_table;
   h->usecount++;
   return hi_obj;
 }
 
+/*
+ * Whether an entry found in a vector which an open table has since
+ * replaced, by a rebuild or clearhash, is still in the table.
+ */
+static int hash_open_live(struct hash *h, val entry)
+{
+  val table;
+  cnum i = hash_open_find(h, car(entry), entry->ch.hash, &table);
+  return i >= 0 && table->v.vec[2 * i + 1] == entry;
+}
+
+/*
+ * Iteration visits the old table first, if the hash was being resized
+ * when the iterator was created. No buckets migrate between the tables
+ * while iterators are active, but an open table may be rebuilt; its
+ * iterators carry on through the vectors they started on, skipping
+ * the entries which have been removed since.
+ */
 val hash_next(val iter)
 {
   struct hash_iter *hi = coerce(struct hash_iter *, cobj_handle(iter, hash_iter_s));
@@ -942,15 +1475,44 @@ val hash_next(val iter)
 
   if (!h)
     return nil;
-  if (hi->cons)
-    hi->cons = cdr(hi->cons);
-  while (nilp(hi->cons)) {
-    if (++hi->chain >= h->modulus) {
-      hi->hash = nil;
-      h->usecount--;
+  if (hi->table) {
+    int stale = (hi->table != h->table);
+    for (;;) {
+      val table = if3(hi->old, hi->old, hi->table);
+      cnum mod = c_num(length_vec(table)) / 2;
+      while (++hi->chain < mod) {
+        val entry = table->v.vec[2 * hi->chain + 1];
+        if (entry && entry != t && (!stale || hash_open_live(h, entry)))
+          return entry;
+      }
+      if (!hi->old)
+        break;
+      hi->old = nil;
+      hi->chain = -1;
+    }
+    hi->hash = nil;
+    hi->table = nil;
+    if (--h->usecount == 0)
+      hash_release_retired(h);
+    return nil;
+  }
+  if (hi->cons)
+    hi->cons = cdr(hi->cons);
+  while (nilp(hi->cons)) {
+    val table = if3(hi->old, hi->old, h->table);
+    cnum mod = if3(hi->old, c_num(length_vec(hi->old)), h->modulus);
+    if (++hi->chain >= mod) {
+      if (hi->old) {
+        hi->old = nil;
+        hi->chain = -1;
+        continue;
+      }
+      hi->hash = nil;
+      if (--h->usecount == 0)
+        hash_release_retired(h);
       return nil;
     }
-    set(mkloc(hi->cons, iter), vecref(h->table, num_fast(hi->chain)));
+    set(mkloc(hi->cons, iter), vecref(table, num_fast(hi->chain)));
   }
   return car(hi->cons);
 }
@@ -977,134 +1539,317 @@ val hash_equal(val obj, val seed)
 }
 
 /*
- * Called from garbage collector. Hash module must process all weak tables
- * that were visited during the marking phase, maintained in the list
- * reachable_weak_hashes.
+ * Weak table processing.
+ *
+ * Each weak table which was reached during marking is scanned once. An
+ * entry whose weak parts are all reachable is live; if it belongs to a
+ * weak-keys table, its value is marked at that point. Each other entry
+ * is noted on the pending list, by the location which refers to it: the
+ * slot of an open table, or the link to its chain cell. Marking values
+ * may reach more keys, and more tables, so the newly reached tables are
+ * scanned and the pending list is revisited until no more values are
+ * marked. The entries which remain pending are dead, and are removed.
+ * Thus, after the first scan, the work is proportional to the number of
+ * unresolved entries, rather than the size of the tables. In a minor
+ * collection, the first scan itself covers only the parts of the tables
+ * which received entries since the previous collection.
  */
-static void do_weak_tables(void)
-{
+struct weak_pend {
   struct hash *h;
+  val table;
+  val *loc;
+};
+
+static struct weak_pend *weak_pend;
+static cnum weak_npend, weak_pend_size;
+
+static void weak_pend_add(struct hash *h, val table, val *loc)
+{
+  if (weak_npend >= weak_pend_size) {
+    cnum size = weak_pend_size ? 2 * weak_pend_size : 256;
+    struct weak_pend *pend = coerce(struct weak_pend *,
+                                    realloc(weak_pend, size * sizeof *pend));
+    if (pend == 0)
+      abort();
+    weak_pend = pend;
+    weak_pend_size = size;
+  }
+
+  weak_pend[weak_npend].h = h;
+  weak_pend[weak_npend].table = table;
+  weak_pend[weak_npend].loc = loc;
+  weak_npend++;
+}
+
+/*
+ * Determine whether the entry is live, marking the value of a live
+ * weak-keys entry. The entry is given together with the chain cell which
+ * holds it, which is nil in an open table. Returns 1 if the entry is live,
+ * 2 if this marked the value.
+ */
+static int weak_entry_live(struct hash *h, val cell, val entry)
+{
+  if (gc_is_reachable(cell) && gc_is_reachable(entry))
+    return 1;
+
+  switch (h->flags) {
+  case hash_weak_keys:
+    if (!gc_is_reachable(entry->c.car))
+      return 0;
+    if (gc_is_reachable(entry->c.cdr))
+      return 1;
+    gc_mark(entry->c.cdr);
+    return 2;
+  case hash_weak_vals:
+    return gc_is_reachable(entry->c.cdr);
+  case hash_weak_both:
+    return gc_is_reachable(entry->c.car) && gc_is_reachable(entry->c.cdr);
+  case hash_weak_none:
+    break;
+  }
+
+  return 1;
+}
+
+/*
+ * Scan a bucket or slot of a table; returns nonzero if values were marked.
+ */
+static int weak_bucket_scan(struct hash *h, val table, cnum i)
+{
+  int marked = 0;
+
+  if (h->hops->open) {
+    val *slot = &table->v.vec[2 * i + 1];
+    int live;
+
+    if (!*slot || *slot == t)
+      return 0;
+
+    if ((live = weak_entry_live(h, nil, *slot)) == 0)
+      weak_pend_add(h, table, slot);
+    marked = (live == 2);
+  } else {
+    val *iter;
+
+    /* A reachable chain cell means that the rest of the chain,
+       with its entries, was marked. */
+    for (iter = &table->v.vec[i]; !gc_is_reachable(*iter);
+         iter = &(*iter)->c.cdr)
+    {
+      int live = weak_entry_live(h, *iter, (*iter)->c.car);
+
+      if (live == 0)
+        weak_pend_add(h, table, iter);
+      marked |= (live == 2);
+    }
+  }
+
+  return marked;
+}
+
+static int weak_table_scan(struct hash *h, val table, cnum modulus)
+{
+  int marked = 0;
   cnum i;
 
-  for (h = reachable_weak_hashes; h != 0; h = h->next) {
-    /* The table of a weak hash was spuriously reached by conservative GC;
-       it's a waste of time doing weak processing, since all keys and
-       values have been transitively marked as reachable; and so we
-       won't find anything to remove. */
-    if (gc_is_reachable(h->table))
-      continue;
+  /* The vector was spuriously reached by conservative GC; all of its
+     keys and values have been transitively marked as reachable, so
+     there is nothing to remove. */
+  if (gc_is_reachable(table))
+    return 0;
 
-    switch (h->flags) {
-    case hash_weak_none:
-      /* what is this doing here */
-      break;
-    case hash_weak_keys:
-      /* Sweep through all entries. Delete any which have keys
-         that are garbage. */
-      for (i = 0; i < h->modulus; i++) {
-        val ind = num_fast(i);
-        val *pchain = valptr(vecref_l(h->table, ind));
-        val *iter;
-
-        for (iter = pchain; !gc_is_reachable(*iter); ) {
-          val entry = car(*iter);
-          if (!gc_is_reachable(entry) && !gc_is_reachable(car(entry))) {
-            *iter = cdr(*iter);
-#if CONFIG_EXTRA_DEBUGGING
-            if (car(entry) == break_obj)
-              breakpt();
+  for (i = 0; i < modulus; i++)
+    marked |= weak_bucket_scan(h, table, i);
+
+  return marked;
+}
+
+#if CONFIG_GEN_GC
+static int weak_dirty_cmp(const void *lp, const void *rp)
+{
+  cnum l = *coerce(const cnum *, lp), r = *coerce(const cnum *, rp);
+  return (l > r) - (l < r);
+}
 #endif
-          } else {
-            iter = valptr(cdr_l(*iter));
-          }
-        }
-      }
-      /* Garbage is gone now. Seal things by marking the vector. */
-      gc_mark(h->table);
-      break;
-    case hash_weak_vals:
-      /* Sweep through all entries. Delete any which have values
-         that are garbage. */
-      for (i = 0; i < h->modulus; i++) {
-        val ind = num_fast(i);
-        val *pchain = valptr(vecref_l(h->table, ind));
-        val *iter;
-
-        for (iter = pchain; !gc_is_reachable(*iter); ) {
-          val entry = car(*iter);
-          if (!gc_is_reachable(entry) && !gc_is_reachable(cdr(entry))) {
-            *iter = cdr(*iter);
-#if CONFIG_EXTRA_DEBUGGING
-            if (cdr(entry) == break_obj)
-              breakpt();
+
+/*
+ * Scan a weak table for the first time; returns nonzero if values were
+ * marked. A minor collection visits only the places noted by hash_dirty,
+ * if any; a full one must visit every entry, since any key may have died.
+ */
+static int weak_hash_scan(struct hash *h)
+{
+  int marked = 0;
+  cnum i;
+
+#if CONFIG_GEN_GC
+  if (!full_gc && h->dirty_serial != gc_serial)
+    return 0;
+
+  if (!full_gc && h->ndirty >= 0) {
+    if (gc_is_reachable(h->table))
+      return 0;
+
+    qsort(h->dirty, h->ndirty, sizeof *h->dirty, weak_dirty_cmp);
+
+    for (i = 0; i < h->ndirty; i++)
+      if (i == 0 || h->dirty[i] != h->dirty[i - 1])
+        marked |= weak_bucket_scan(h, h->table, h->dirty[i]);
+
+    return marked;
+  }
 #endif
-          } else {
-            iter = valptr(cdr_l(*iter));
-          }
-        }
-      }
-      /* Garbage is gone now. Seal things by marking the vector. */
-      gc_mark(h->table);
-      break;
-    case hash_weak_both:
-      /* Sweep through all entries. Delete any which have keys
-         or values that are garbage. */
-      for (i = 0; i < h->modulus; i++) {
-        val ind = num_fast(i);
-        val *pchain = valptr(vecref_l(h->table, ind));
-        val *iter;
-
-        for (iter = pchain; !gc_is_reachable(*iter); ) {
-          val entry = car(*iter);
-          if (!gc_is_reachable(entry) &&
-              (!gc_is_reachable(car(entry)) || !gc_is_reachable(cdr(entry))))
-          {
-            *iter = cdr(*iter);
+
+  marked |= weak_table_scan(h, h->table, h->modulus);
+
+  if (h->old_table)
+    marked |= weak_table_scan(h, h->old_table, h->old_modulus);
+
+  for (i = 0; i < h->nretired; i++)
+    marked |= weak_table_scan(h, h->retired[i],
+                              hash_vec_modulus(h, h->retired[i]));
+
+  return marked;
+}
+
+/*
+ * Revisit the pending entries, dropping those which were found live;
+ * returns nonzero if values were marked.
+ */
+static int weak_pend_rescan(void)
+{
+  int marked = 0;
+  cnum i, j;
+
+  for (i = j = 0; i < weak_npend; i++) {
+    struct weak_pend *p = &weak_pend[i];
+    int live;
+
+    if (p->h->hops->open)
+      live = weak_entry_live(p->h, nil, *p->loc);
+    else
+      live = weak_entry_live(p->h, *p->loc, (*p->loc)->c.car);
+
+    if (live == 0)
+      weak_pend[j++] = *p;
+    marked |= (live == 2);
+  }
+
+  weak_npend = j;
+  return marked;
+}
+
+/*
+ * Remove the dead entries. This is done in the reverse of the order in
+ * which they were noted, so that when consecutive cells of a chain are
+ * unlinked, the link to a later cell is not lost in an earlier one
+ * which was already unlinked. Entries of retired vectors are not
+ * counted; those which are still in the table are found in its current
+ * vectors, too.
+ */
+static void weak_pend_remove(void)
+{
+  cnum i;
+
+  for (i = weak_npend - 1; i >= 0; i--) {
+    struct weak_pend *p = &weak_pend[i];
+    struct hash *h = p->h;
+    val entry;
+
+    if (h->hops->open) {
+      entry = *p->loc;
+      *p->loc = t;
+      if (p->table == h->table)
+        h->tombs++;
+    } else {
+      entry = (*p->loc)->c.car;
+      *p->loc = (*p->loc)->c.cdr;
+    }
+
+    if (p->table == h->table || p->table == h->old_table)
+      h->count--;
 #if CONFIG_EXTRA_DEBUGGING
-            if (!gc_is_reachable(car(entry)) && car(entry) == break_obj)
-              breakpt();
-            if (!gc_is_reachable(cdr(entry)) && cdr(entry) == break_obj)
-              breakpt();
+    if (entry->c.car == break_obj || entry->c.cdr == break_obj)
+      breakpt();
+#else
+    (void) entry;
 #endif
-          } else {
-            iter = valptr(cdr_l(*iter));
-          }
-        }
-      }
-      /* Garbage is gone now. Seal things by marking the vector. */
-      gc_mark(h->table);
-      break;
-    }
   }
 
-  /* Done with weak processing; clear out the list in preparation for
-     the next gc round. */
-  reachable_weak_hashes = 0;
+  weak_npend = 0;
+}
+
+/*
+ * Called from garbage collector. Hash module must process all weak tables
+ * that were visited during the marking phase, which are among those in
+ * the list reachable_hashes. Since marking may list more tables, the
+ * list is scanned from its head down to where the previous pass began.
+ */
+static void do_weak_tables(void)
+{
+  struct hash *h, *done = 0;
+  int marked;
+
+  do {
+    struct hash *head = reachable_hashes;
+    marked = 0;
+
+    for (h = head; h != done; h = h->next) {
+      if (h->flags != hash_weak_none)
+        marked |= weak_hash_scan(h);
+    }
+
+    done = head;
+    marked |= weak_pend_rescan();
+  } while (marked || reachable_hashes != done);
+
+  weak_pend_remove();
+
+  /* Garbage is gone now. Seal things by marking the vectors. */
+  for (h = reachable_hashes; h != 0; h = h->next) {
+    cnum i;
+    if (h->flags == hash_weak_none)
+      continue;
+    gc_mark(h->table);
+    gc_mark(h->old_table);
+    for (i = 0; i < h->nretired; i++)
+      gc_mark(h->retired[i]);
+  }
 }
 
 static void do_iters(void)
 {
   struct hash_iter *hi;
+  struct hash *h;
+
+  for (h = reachable_hashes; h != 0; h = h->next)
+    h->usecount = 0;
 
   for (hi = reachable_iters; hi != 0; hi = hi->next) {
     val hash = hi->hash;
 
+    hi->listed = 0;
+
     if (!hash)
       continue;
 
-#if CONFIG_GEN_GC
-    /* If the hash is a tenured object, we do not touch it.
-       It wasn't marked and so its usecount wasn't reset to zero. */
-    if (!full_gc && hash->t.gen > 0)
-      continue;
-#endif
+    /* If the hash wasn't marked (for instance, it is a tenured
+       object not visited by a partial collection), its usecount
+       wasn't reset to zero, so we do not touch it. */
+    h = coerce(struct hash *, hash->co.handle);
 
-    {
-      struct hash *h = coerce(struct hash *, hash->co.handle);
+    if (h->listed)
       h->usecount++;
-    }
   }
 
+  for (h = reachable_hashes; h != 0; h = h->next) {
+    if (h->usecount == 0)
+      hash_release_retired(h);
+    h->listed = 0;
+  }
+
+  /* Done; clear out the lists in preparation for the next gc round. */
+  reachable_hashes = 0;
   reachable_iters = 0;
 }
 
@@ -1490,88 +2235,1235 @@ val hash_revget(val hash, val value, val test, val keyfun)
   return nil;
 }
 
-static val set_hash_str_limit(val lim)
+/*
+ * Persistent hash maps.
+ *
+ * A hamt is an immutable map, represented as a hash array mapped trie.
+ * Updating it produces a new map, which shares with the old one all but
+ * the path to the changed entry. The trie is made of slots: a slot is
+ * nil, an entry or a node. Entries are hash conses, as in hash tables.
+ * A node is a vector which holds a bitmap, the count of the entries under
+ * it, and its children. Each level of the trie is indexed by a fragment of
+ * HAMT_BITS bits of the hash code; the bitmap has a bit for each fragment
+ * which occurs, and the children are stored in the order of those bits.
+ * Once the hash code is used up, entries whose codes are equal are kept
+ * in a collision node, whose bitmap is nil. A node is never left holding
+ * just one entry; it is replaced by that entry, so that a given set of
+ * keys always has the same shape, apart from the order within collision
+ * nodes. The set operations walk two tries together, and take unchanged
+ * subtrees into their result as they are.
+ */
+
+#if SIZEOF_PTR >= 8
+#define HAMT_BITS 5
+#else
+#define HAMT_BITS 4
+#endif
+#define HAMT_WIDTH (1 << HAMT_BITS)
+#define HAMT_MASK (HAMT_WIDTH - 1)
+#define HAMT_HASH_BITS (convert(int, sizeof (ucnum)) * CHAR_BIT)
+
+struct hamt {
+  ucnum seed;
+  struct hash_ops *hops;
+  val root;
+};
+
+val hamt_s;
+
+static int hamt_popcount(ucnum bits)
 {
-  val old = num(hash_str_limit);
-  hash_str_limit = c_num(lim);
-  return old;
+  u32_t x = convert(u32_t, bits);
+  x = x - ((x >> 1) & 0x55555555);
+  x = (x & 0x33333333) + ((x >> 2) & 0x33333333);
+  x = (x + (x >> 4)) & 0x0F0F0F0F;
+  return convert(int, (x * 0x01010101) >> 24);
 }
 
-static val set_hash_rec_limit(val lim)
+static int hamt_nodep(val slot)
 {
-  val old = num(hash_rec_limit);
-  hash_rec_limit = c_num(lim);
-  return old;
+  return slot && type(slot) == VEC;
 }
 
-static val gen_hash_seed(void)
+static cnum hamt_slot_count(val slot)
 {
-    val time = time_sec_usec();
-    ucnum sec = convert(ucnum, c_num(car(time)));
-    ucnum usec = convert(ucnum, c_num(cdr(time)));
-#if HAVE_UNISTD_H
-    ucnum pid = convert(ucnum, getpid());
-#else
-    ucnum pid = 0;
-#endif
-    return unum(sec ^ (usec << 12) ^ pid);
+  if (slot == nil)
+    return 0;
+  if (hamt_nodep(slot))
+    return c_num(slot->v.vec[1]);
+  return 1;
 }
 
-void hash_init(void)
+static int hamt_node_size(val node)
 {
-  weak_keys_k = intern(lit("weak-keys"), keyword_package);
-  weak_vals_k = intern(lit("weak-vals"), keyword_package);
-  equal_based_k = intern(lit("equal-based"), keyword_package);
-  eql_based_k = intern(lit("eql-based"), keyword_package);
-  userdata_k = intern(lit("userdata"), keyword_package);
-  hash_seed_s = intern(lit("*hash-seed*"), user_package);
-  val ghu = func_n1(get_hash_userdata);
+  return c_num(node->v.vec[vec_length]) - 2;
+}
 
-  reg_var(hash_seed_s, zero);
+static ucnum hamt_entry_hash(val entry)
+{
+  return convert(ucnum, entry->ch.hash);
+}
 
-  reg_fun(intern(lit("make-hash"), user_package), func_n4o(make_seeded_hash, 3));
-  reg_fun(intern(lit("make-similar-hash"), user_package), func_n1(make_similar_hash));
-  reg_fun(intern(lit("copy-hash"), user_package), func_n1(copy_hash));
-  reg_fun(intern(lit("hash"), user_package), func_n0v(hashv));
-  reg_fun(hash_construct_s, func_n2(hash_construct));
-  reg_fun(intern(lit("hash-from-pairs"), user_package), func_n1v(hash_from_pairs_v));
-  reg_fun(intern(lit("hash-list"), user_package), func_n1v(hash_list));
-  reg_fun(intern(lit("gethash"), user_package), func_n3o(gethash_n, 2));
-  reg_fun(intern(lit("inhash"), user_package), func_n3o(inhash, 2));
-  reg_fun(intern(lit("sethash"), user_package), func_n3(sethash));
-  reg_fun(intern(lit("pushhash"), user_package), func_n3(pushhash));
-  reg_fun(intern(lit("remhash"), user_package), func_n2(remhash));
-  reg_fun(intern(lit("clearhash"), user_package), func_n1(clearhash));
-  reg_fun(intern(lit("hash-count"), user_package), func_n1(hash_count));
-  reg_fun(intern(lit("get-hash-userdata"), user_package), ghu);
-  reg_fun(intern(lit("hash-userdata"), user_package), ghu);
-  reg_fun(intern(lit("set-hash-userdata"), user_package),
-          func_n2(set_hash_userdata));
-  reg_fun(intern(lit("hashp"), user_package), func_n1(hashp));
-  reg_fun(intern(lit("maphash"), user_package), func_n2(maphash));
-  reg_fun(intern(lit("hash-eql"), user_package), func_n1(hash_eql));
-  reg_fun(intern(lit("hash-equal"), user_package), func_n2o(hash_equal, 1));
-  reg_fun(intern(lit("hash-keys"), user_package), func_n1(hash_keys));
-  reg_fun(intern(lit("hash-values"), user_package), func_n1(hash_values));
-  reg_fun(intern(lit("hash-pairs"), user_package), func_n1(hash_pairs));
-  reg_fun(intern(lit("hash-alist"), user_package), func_n1(hash_alist));
-  reg_fun(intern(lit("hash-uni"), user_package), func_n3o(hash_uni, 2));
-  reg_fun(intern(lit("hash-diff"), user_package), func_n2(hash_diff));
-  reg_fun(intern(lit("hash-isec"), user_package), func_n3o(hash_isec, 2));
-  reg_fun(intern(lit("hash-subset"), user_package), func_n2(hash_subset));
-  reg_fun(intern(lit("hash-proper-subset"), user_package), func_n2(hash_proper_subset));
-  reg_fun(intern(lit("group-by"), user_package), func_n2v(group_by));
-  reg_fun(intern(lit("group-reduce"), user_package),
-          func_n6o(group_reduce, 4));
-  reg_fun(intern(lit("hash-update"), user_package), func_n2(hash_update));
-  reg_fun(intern(lit("hash-update-1"), user_package),
-          func_n4o(hash_update_1, 3));
-  reg_fun(intern(lit("hash-revget"), user_package), func_n4o(hash_revget, 2));
-  reg_fun(intern(lit("hash-begin"), user_package), func_n1(hash_begin));
-  reg_fun(intern(lit("hash-next"), user_package), func_n1(hash_next));
-  reg_fun(intern(lit("set-hash-str-limit"), system_package),
-          func_n1(set_hash_str_limit));
-  reg_fun(intern(lit("set-hash-rec-limit"), system_package),
-          func_n1(set_hash_rec_limit));
-  reg_fun(intern(lit("gen-hash-seed"), user_package), func_n0(gen_hash_seed));
+static int hamt_entry_match(struct hash_ops *hops, val entry,
+                            val key, ucnum hc)
+{
+  return hamt_entry_hash(entry) == hc && hops->equal_fun(car(entry), key);
+}
+
+/*
+ * Construct a node from the given children, or the slot which stands
+ * for them if there are fewer than two entries.
+ */
+static val hamt_node(val bitmap, val *kid, int n)
+{
+  cnum count = 0;
+  val node;
+  int i;
+
+  if (n == 0)
+    return nil;
+
+  if (n == 1 && !hamt_nodep(kid[0]))
+    return kid[0];
+
+  for (i = 0; i < n; i++)
+    count += hamt_slot_count(kid[i]);
+
+  node = vector(num_fast(n + 2), nil);
+  node->v.vec[0] = bitmap;
+  node->v.vec[1] = num(count);
+  for (i = 0; i < n; i++)
+    node->v.vec[i + 2] = kid[i];
+  return node;
+}
+
+/*
+ * Copy a node, replacing child i with kid, or removing it if kid
+ * is nil; bitmap is the bitmap of the new node.
+ */
+static val hamt_node_set(val node, int i, val kid, val bitmap)
+{
+  int n = hamt_node_size(node), j, k;
+  cnum count = c_num(node->v.vec[1]) - hamt_slot_count(node->v.vec[i + 2]);
+  val copy;
+
+  if (kid == nil) {
+    if (n == 1)
+      return nil;
+    if (n == 2 && !hamt_nodep(node->v.vec[3 - i]))
+      return node->v.vec[3 - i];
+    copy = vector(num_fast(n + 1), nil);
+    for (j = k = 0; j < n; j++)
+      if (j != i)
+        copy->v.vec[2 + k++] = node->v.vec[j + 2];
+  } else {
+    if (n == 1 && !hamt_nodep(kid))
+      return kid;
+    count += hamt_slot_count(kid);
+    copy = vector(num_fast(n + 2), nil);
+    for (j = 0; j < n; j++)
+      copy->v.vec[j + 2] = node->v.vec[j + 2];
+    copy->v.vec[i + 2] = kid;
+  }
+
+  copy->v.vec[0] = bitmap;
+  copy->v.vec[1] = num(count);
+  return copy;
+}
+
+/*
+ * Copy a node, inserting a new child at position i.
+ */
+static val hamt_node_insert(val node, int i, val kid, val bitmap)
+{
+  int n = hamt_node_size(node), j;
+  cnum count = c_num(node->v.vec[1]) + hamt_slot_count(kid);
+  val copy = vector(num_fast(n + 3), nil);
+
+  for (j = 0; j < i; j++)
+    copy->v.vec[j + 2] = node->v.vec[j + 2];
+  copy->v.vec[i + 2] = kid;
+  for (; j < n; j++)
+    copy->v.vec[j + 3] = node->v.vec[j + 2];
+
+  copy->v.vec[0] = bitmap;
+  copy->v.vec[1] = num(count);
+  return copy;
+}
+
+static int hamt_frag(ucnum hc, int shift)
+{
+  return (hc >> shift) & HAMT_MASK;
+}
+
+static val hamt_find(struct hash_ops *hops, val slot, val key,
+                     ucnum hc, int shift)
+{
+  for (;;) {
+    ucnum bm, bit;
+
+    if (slot == nil)
+      return nil;
+
+    if (!hamt_nodep(slot))
+      return if2(hamt_entry_match(hops, slot, key, hc), slot);
+
+    if (slot->v.vec[0] == nil) {
+      int i, n = hamt_node_size(slot);
+      for (i = 0; i < n; i++)
+        if (hamt_entry_match(hops, slot->v.vec[i + 2], key, hc))
+          return slot->v.vec[i + 2];
+      return nil;
+    }
+
+    bm = c_unum(slot->v.vec[0]);
+    bit = convert(ucnum, 1) << hamt_frag(hc, shift);
+
+    if ((bm & bit) == 0)
+      return nil;
+
+    slot = slot->v.vec[2 + hamt_popcount(bm & (bit - 1))];
+    shift += HAMT_BITS;
+  }
+}
+
+/*
+ * Make a slot holding two entries with distinct keys.
+ */
+static val hamt_pair(val e1, val e2, int shift)
+{
+  ucnum h1 = hamt_entry_hash(e1), h2 = hamt_entry_hash(e2);
+  val kid[2];
+  int f1, f2;
+
+  if (shift >= HAMT_HASH_BITS) {
+    kid[0] = e1;
+    kid[1] = e2;
+    return hamt_node(nil, kid, 2);
+  }
+
+  f1 = hamt_frag(h1, shift);
+  f2 = hamt_frag(h2, shift);
+
+  if (f1 == f2) {
+    kid[0] = hamt_pair(e1, e2, shift + HAMT_BITS);
+    return hamt_node(unum(convert(ucnum, 1) << f1), kid, 1);
+  }
+
+  kid[f1 > f2] = e1;
+  kid[f1 < f2] = e2;
+  return hamt_node(unum((convert(ucnum, 1) << f1) | (convert(ucnum, 1) << f2)),
+                   kid, 2);
+}
+
+/*
+ * Resolve the entry x being added against the existing entry e of the
+ * same key. Without a join function, x replaces e, or e is kept if swap
+ * is true. With one, the value is the join of the values, in which the
+ * value of x comes first, or second if swap is true.
+ */
+static val hamt_join(val x, val e, val join, int swap)
+{
+  val nv;
+
+  if (missingp(join))
+    return swap ? e : x;
+
+  nv = if3(swap, funcall2(join, cdr(e), cdr(x)), funcall2(join, cdr(x), cdr(e)));
+
+  if (nv == cdr(e))
+    return e;
+  if (nv == cdr(x))
+    return x;
+  return hash_cons(car(e), nv, e->ch.hash);
+}
+
+/*
+ * Add entry x to the slot, returning the new slot; *added is set if
+ * the key was not already present.
+ */
+static val hamt_put(struct hash_ops *hops, val slot, val x, int shift,
+                    val join, int swap, int *added)
+{
+  ucnum hc = hamt_entry_hash(x);
+  ucnum bm, bit;
+  int i, n;
+
+  if (slot == nil) {
+    *added = 1;
+    return x;
+  }
+
+  if (!hamt_nodep(slot)) {
+    if (hamt_entry_match(hops, slot, car(x), hc)) {
+      val e = hamt_join(x, slot, join, swap);
+      return if3(e == slot || cdr(e) != cdr(slot), e, slot);
+    }
+    *added = 1;
+    return hamt_pair(slot, x, shift);
+  }
+
+  n = hamt_node_size(slot);
+
+  if (slot->v.vec[0] == nil) {
+    for (i = 0; i < n; i++) {
+      val e = slot->v.vec[i + 2];
+      if (hamt_entry_match(hops, e, car(x), hc)) {
+        val ne = hamt_join(x, e, join, swap);
+        if (ne == e || cdr(ne) == cdr(e))
+          return slot;
+        return hamt_node_set(slot, i, ne, nil);
+      }
+    }
+    *added = 1;
+    return hamt_node_insert(slot, n, x, nil);
+  }
+
+  bm = c_unum(slot->v.vec[0]);
+  bit = convert(ucnum, 1) << hamt_frag(hc, shift);
+  i = hamt_popcount(bm & (bit - 1));
+
+  if ((bm & bit) != 0) {
+    val kid = slot->v.vec[i + 2];
+    val nkid = hamt_put(hops, kid, x, shift + HAMT_BITS, join, swap, added);
+    return if3(nkid == kid, slot, hamt_node_set(slot, i, nkid, slot->v.vec[0]));
+  }
+
+  *added = 1;
+  return hamt_node_insert(slot, i, x, unum(bm | bit));
+}
+
+/*
+ * Remove the entry for key from the slot, returning the new slot,
+ * which is the same slot if the key is not present.
+ */
+static val hamt_remove(struct hash_ops *hops, val slot, val key,
+                       ucnum hc, int shift)
+{
+  ucnum bm, bit;
+  int i, n;
+
+  if (slot == nil)
+    return nil;
+
+  if (!hamt_nodep(slot))
+    return if2(!hamt_entry_match(hops, slot, key, hc), slot);
+
+  n = hamt_node_size(slot);
+
+  if (slot->v.vec[0] == nil) {
+    for (i = 0; i < n; i++)
+      if (hamt_entry_match(hops, slot->v.vec[i + 2], key, hc))
+        return hamt_node_set(slot, i, nil, nil);
+    return slot;
+  }
+
+  bm = c_unum(slot->v.vec[0]);
+  bit = convert(ucnum, 1) << hamt_frag(hc, shift);
+  i = hamt_popcount(bm & (bit - 1));
+
+  if ((bm & bit) == 0) {
+    return slot;
+  } else {
+    val kid = slot->v.vec[i + 2];
+    val nkid = hamt_remove(hops, kid, key, hc, shift + HAMT_BITS);
+
+    if (nkid == kid)
+      return slot;
+
+    if (nkid == nil) {
+      bm &= ~bit;
+      return hamt_node_set(slot, i, nil, if2(bm, unum(bm)));
+    }
+
+    return hamt_node_set(slot, i, nkid, slot->v.vec[0]);
+  }
+}
+
+static val hamt_uni_slot(struct hash_ops *hops, val a, val b,
+                         val join, int shift)
+{
+  int dummy;
+
+  if (a == nil)
+    return b;
+  if (b == nil || (a == b && missingp(join)))
+    return a;
+
+  if (!hamt_nodep(a))
+    return hamt_put(hops, b, a, shift, join, 0, &dummy);
+
+  if (!hamt_nodep(b))
+    return hamt_put(hops, a, b, shift, join, 1, &dummy);
+
+  if (a->v.vec[0] == nil) {
+    int i, n = hamt_node_size(b);
+    for (i = 0; i < n; i++)
+      a = hamt_put(hops, a, b->v.vec[i + 2], shift, join, 1, &dummy);
+    return a;
+  } else {
+    ucnum bma = c_unum(a->v.vec[0]), bmb = c_unum(b->v.vec[0]);
+    ucnum bm = bma | bmb, bit;
+    val kid[HAMT_WIDTH];
+    int ia = 0, ib = 0, n = 0, same = (bm == bma);
+
+    for (bit = 1; bit != 0 && bit <= bm; bit <<= 1) {
+      if ((bm & bit) == 0)
+        continue;
+      if ((bma & bit) && (bmb & bit)) {
+        val ka = a->v.vec[2 + ia++];
+        kid[n] = hamt_uni_slot(hops, ka, b->v.vec[2 + ib++],
+                               join, shift + HAMT_BITS);
+        same = same && (kid[n] == ka);
+      } else if (bma & bit) {
+        kid[n] = a->v.vec[2 + ia++];
+      } else {
+        kid[n] = b->v.vec[2 + ib++];
+      }
+      n++;
+    }
+
+    return if3(same, a, hamt_node(unum(bm), kid, n));
+  }
+}
+
+static val hamt_diff_slot(struct hash_ops *hops, val a, val b, int shift)
+{
+  if (a == nil || a == b)
+    return nil;
+  if (b == nil)
+    return a;
+
+  if (!hamt_nodep(a))
+    return if2(!hamt_find(hops, b, car(a), hamt_entry_hash(a), shift), a);
+
+  if (!hamt_nodep(b))
+    return hamt_remove(hops, a, car(b), hamt_entry_hash(b), shift);
+
+  if (a->v.vec[0] == nil) {
+    int i, n = hamt_node_size(b);
+    for (i = 0; i < n; i++) {
+      val x = b->v.vec[i + 2];
+      a = hamt_remove(hops, a, car(x), hamt_entry_hash(x), shift);
+    }
+    return a;
+  } else {
+    ucnum bma = c_unum(a->v.vec[0]), bmb = c_unum(b->v.vec[0]);
+    ucnum bm = 0, bit;
+    val kid[HAMT_WIDTH];
+    int ia = 0, ib = 0, n = 0, same = 1;
+
+    for (bit = 1; bit != 0 && bit <= bma; bit <<= 1) {
+      val ka, k;
+
+      if ((bma & bit) == 0) {
+        if (bmb & bit)
+          ib++;
+        continue;
+      }
+
+      ka = a->v.vec[2 + ia++];
+      k = if3(bmb & bit,
+              hamt_diff_slot(hops, ka, b->v.vec[2 + ib++], shift + HAMT_BITS),
+              ka);
+
+      same = same && (k == ka);
+
+      if (k) {
+        kid[n++] = k;
+        bm |= bit;
+      }
+    }
+
+    return if3(same, a, hamt_node(unum(bm), kid, n));
+  }
+}
+
+static val hamt_isec_entry(struct hash_ops *hops, val x, val b,
+                           val join, int swap, int shift)
+{
+  val e = hamt_find(hops, b, car(x), hamt_entry_hash(x), shift);
+
+  if (!e)
+    return nil;
+
+  return hamt_join(x, e, join, swap);
+}
+
+static val hamt_isec_slot(struct hash_ops *hops, val a, val b,
+                          val join, int shift)
+{
+  if (a == nil || b == nil)
+    return nil;
+  if (a == b && missingp(join))
+    return a;
+
+  if (!hamt_nodep(a))
+    return hamt_isec_entry(hops, a, b, join, 0, shift);
+
+  if (!hamt_nodep(b))
+    return hamt_isec_entry(hops, b, a, join, 1, shift);
+
+  if (a->v.vec[0] == nil) {
+    int i, n = hamt_node_size(a), dummy;
+    val out = nil;
+    for (i = 0; i < n; i++) {
+      val e = hamt_isec_entry(hops, a->v.vec[i + 2], b, join, 0, shift);
+      if (e)
+        out = hamt_put(hops, out, e, shift, colon_k, 0, &dummy);
+    }
+    return out;
+  } else {
+    ucnum bma = c_unum(a->v.vec[0]), bmb = c_unum(b->v.vec[0]);
+    ucnum bm = 0, bit;
+    val kid[HAMT_WIDTH];
+    int ia = 0, ib = 0, n = 0, same = (bma == (bma & bmb));
+
+    for (bit = 1; bit != 0 && bit <= (bma | bmb); bit <<= 1) {
+      val ka, kb, k;
+
+      if ((bma & bit) == 0 || (bmb & bit) == 0) {
+        ia += ((bma & bit) != 0);
+        ib += ((bmb & bit) != 0);
+        continue;
+      }
+
+      ka = a->v.vec[2 + ia++];
+      kb = b->v.vec[2 + ib++];
+      k = hamt_isec_slot(hops, ka, kb, join, shift + HAMT_BITS);
+
+      same = same && (k == ka);
+
+      if (k) {
+        kid[n++] = k;
+        bm |= bit;
+      }
+    }
+
+    return if3(same, a, hamt_node(unum(bm), kid, n));
+  }
+}
+
+enum hamt_collect { hamt_keys_c, hamt_values_c, hamt_pairs_c };
+
+static loc hamt_collect(val slot, loc ptail, enum hamt_collect what)
+{
+  if (slot == nil) {
+    return ptail;
+  } else if (!hamt_nodep(slot)) {
+    switch (what) {
+    case hamt_keys_c:
+      return list_collect(ptail, car(slot));
+    case hamt_values_c:
+      return list_collect(ptail, cdr(slot));
+    case hamt_pairs_c:
+      return list_collect(ptail, list(car(slot), cdr(slot), nao));
+    }
+    return ptail;
+  } else {
+    int i, n = hamt_node_size(slot);
+    for (i = 0; i < n; i++)
+      ptail = hamt_collect(slot->v.vec[i + 2], ptail, what);
+    return ptail;
+  }
+}
+
+static val hamt_equal_op(val left, val right)
+{
+  struct hamt *l = coerce(struct hamt *, left->co.handle);
+  struct hamt *r = coerce(struct hamt *, right->co.handle);
+  val iter;
+
+  if (l->hops != r->hops ||
+      hamt_slot_count(l->root) != hamt_slot_count(r->root))
+    return nil;
+
+  if (l->root == r->root)
+    return t;
+
+  for (iter = hamt_pairs(left); iter; iter = cdr(iter)) {
+    val entry = car(iter);
+    int lim = hash_rec_limit;
+    val key = car(entry);
+    ucnum hc = r->hops->hash_fun(key, &lim, r->seed);
+    val found = hamt_find(r->hops, r->root, key, hc, 0);
+
+    if (!found || !equal(cadr(entry), cdr(found)))
+      return nil;
+  }
+
+  gc_hint(right);
+
+  return t;
+}
+
+static void hamt_print_op(val map, val out, val pretty, struct strm_ctx *ctx)
+{
+  struct hamt *m = coerce(struct hamt *, map->co.handle);
+
+  put_string(lit("#<hamt"), out);
+  if (m->hops == &hash_equal_ops) {
+    put_char(chr(' '), out);
+    obj_print_impl(equal_based_k, out, pretty, ctx);
+  }
+  put_char(chr(' '), out);
+  obj_print_impl(hamt_pairs(map), out, pretty, ctx);
+  put_char(chr('>'), out);
+}
+
+static void hamt_mark(val map)
+{
+  struct hamt *m = coerce(struct hamt *, map->co.handle);
+  gc_mark(m->root);
+}
+
+static ucnum hamt_hash_op(val map, int *count, ucnum seed)
+{
+  struct hamt *m = coerce(struct hamt *, map->co.handle);
+  ucnum out = coerce(ucnum, m->hops) >> 5;
+  val iter;
+
+  if ((*count)-- <= 0)
+    return 0;
+
+  out &= NUM_MAX;
+
+  for (iter = hamt_pairs(map); iter; iter = cdr(iter)) {
+    out += equal_hash(car(iter), count, seed);
+    out &= NUM_MAX;
+  }
+
+  return out;
+}
+
+static struct cobj_ops hamt_ops = cobj_ops_init(hamt_equal_op,
+                                                hamt_print_op,
+                                                cobj_destroy_free_op,
+                                                hamt_mark,
+                                                hamt_hash_op);
+
+static val hamt_make(struct hash_ops *hops, ucnum seed, val root)
+{
+  struct hamt *m = coerce(struct hamt *, chk_malloc(sizeof *m));
+  val map;
+
+  m->hops = hops;
+  m->seed = seed;
+  m->root = nil;
+  map = cobj(coerce(mem_t *, m), hamt_s, &hamt_ops);
+  m->root = root;
+  return map;
+}
+
+static ucnum hamt_hash(struct hamt *m, val key)
+{
+  int lim = hash_rec_limit;
+  return m->hops->hash_fun(key, &lim, m->seed);
+}
+
+static void hamt_setup(struct hamt *m, val equal_based, val seed)
+{
+  m->hops = if3(default_null_arg(equal_based), &hash_equal_ops, &hash_eql_ops);
+  m->seed = convert(u32_t, c_unum(default_arg(seed,
+                                              if3(hash_seed_s,
+                                                  hash_seed, zero))));
+  m->root = nil;
+}
+
+val make_hamt(val equal_based, val seed)
+{
+  struct hamt m;
+  hamt_setup(&m, equal_based, seed);
+  return hamt_make(m.hops, m.seed, nil);
+}
+
+val hamtp(val obj)
+{
+  return tnil(typeof(obj) == hamt_s);
+}
+
+val hamt_count(val map)
+{
+  struct hamt *m = coerce(struct hamt *, cobj_handle(map, hamt_s));
+  return num(hamt_slot_count(m->root));
+}
+
+val hamt_get(val map, val key, val notfound_val)
+{
+  struct hamt *m = coerce(struct hamt *, cobj_handle(map, hamt_s));
+  val entry = hamt_find(m->hops, m->root, key, hamt_hash(m, key), 0);
+  gc_hint(map);
+  return if3(entry, cdr(entry), default_null_arg(notfound_val));
+}
+
+val hamt_in(val map, val key)
+{
+  struct hamt *m = coerce(struct hamt *, cobj_handle(map, hamt_s));
+  val entry = hamt_find(m->hops, m->root, key, hamt_hash(m, key), 0);
+  gc_hint(map);
+  return if2(entry, cons(car(entry), cdr(entry)));
+}
+
+val hamt_with(val map, val key, val value)
+{
+  struct hamt *m = coerce(struct hamt *, cobj_handle(map, hamt_s));
+  ucnum hc = hamt_hash(m, key);
+  val entry = hash_cons(key, value, hc);
+  int added = 0;
+  val root = hamt_put(m->hops, m->root, entry, 0, colon_k, 0, &added);
+  return if3(root == m->root, map, hamt_make(m->hops, m->seed, root));
+}
+
+val hamt_without(val map, val key)
+{
+  struct hamt *m = coerce(struct hamt *, cobj_handle(map, hamt_s));
+  val root = hamt_remove(m->hops, m->root, key, hamt_hash(m, key), 0);
+  return if3(root == m->root, map, hamt_make(m->hops, m->seed, root));
+}
+
+val hamt_from_pairs(val pairs, val equal_based)
+{
+  struct hamt m;
+  val iter, root = nil;
+
+  hamt_setup(&m, equal_based, colon_k);
+
+  for (iter = pairs; iter; iter = cdr(iter)) {
+    val pair = car(iter);
+    val key = car(pair);
+    val entry = hash_cons(key, cadr(pair), hamt_hash(&m, key));
+    int added = 0;
+    root = hamt_put(m.hops, root, entry, 0, colon_k, 0, &added);
+  }
+
+  return hamt_make(m.hops, m.seed, root);
+}
+
+val hamt_keys(val map)
+{
+  struct hamt *m = coerce(struct hamt *, cobj_handle(map, hamt_s));
+  list_collect_decl (out, ptail);
+  hamt_collect(m->root, ptail, hamt_keys_c);
+  return out;
+}
+
+val hamt_values(val map)
+{
+  struct hamt *m = coerce(struct hamt *, cobj_handle(map, hamt_s));
+  list_collect_decl (out, ptail);
+  hamt_collect(m->root, ptail, hamt_values_c);
+  return out;
+}
+
+val hamt_pairs(val map)
+{
+  struct hamt *m = coerce(struct hamt *, cobj_handle(map, hamt_s));
+  list_collect_decl (out, ptail);
+  hamt_collect(m->root, ptail, hamt_pairs_c);
+  return out;
+}
+
+/*
+ * Obtain the root of map2 for a set operation with map1. If the maps
+ * were made with different seeds, map2 is rebuilt with the seed of map1.
+ */
+static val hamt_operand(val map1, val map2, val self)
+{
+  struct hamt *m1 = coerce(struct hamt *, cobj_handle(map1, hamt_s));
+  struct hamt *m2 = coerce(struct hamt *, cobj_handle(map2, hamt_s));
+
+  if (m1->hops != m2->hops)
+    uw_throwf(error_s, lit("~a: ~s and ~s are incompatible maps"),
+              self, map1, map2, nao);
+
+  if (m1->seed != m2->seed) {
+    val iter, root = nil;
+
+    for (iter = hamt_pairs(map2); iter; iter = cdr(iter)) {
+      val key = car(car(iter));
+      val entry = hash_cons(key, cadr(car(iter)), hamt_hash(m1, key));
+      int added = 0;
+      root = hamt_put(m1->hops, root, entry, 0, colon_k, 0, &added);
+    }
+
+    return root;
+  }
+
+  return m2->root;
+}
+
+val hamt_uni(val map1, val map2, val join_func)
+{
+  struct hamt *m = coerce(struct hamt *, cobj_handle(map1, hamt_s));
+  val b = hamt_operand(map1, map2, lit("hamt-uni"));
+  val root = hamt_uni_slot(m->hops, m->root, b, join_func, 0);
+  return if3(root == m->root, map1, hamt_make(m->hops, m->seed, root));
+}
+
+val hamt_diff(val map1, val map2)
+{
+  struct hamt *m = coerce(struct hamt *, cobj_handle(map1, hamt_s));
+  val b = hamt_operand(map1, map2, lit("hamt-diff"));
+  val root = hamt_diff_slot(m->hops, m->root, b, 0);
+  return if3(root == m->root, map1, hamt_make(m->hops, m->seed, root));
+}
+
+val hamt_isec(val map1, val map2, val join_func)
+{
+  struct hamt *m = coerce(struct hamt *, cobj_handle(map1, hamt_s));
+  val b = hamt_operand(map1, map2, lit("hamt-isec"));
+  val root = hamt_isec_slot(m->hops, m->root, b, join_func, 0);
+  return if3(root == m->root, map1, hamt_make(m->hops, m->seed, root));
+}
+
+/*
+ * Bounded caches. An LRU cache is a hash table which maps each key to
+ * the index of a node in a separately allocated array. The nodes are
+ * kept in a circular doubly linked list in order of use, the most
+ * recently used first; node 0 is the list head, and nodes not in use
+ * are chained through their next fields into a free list. Each node
+ * records the key, the value and the cost reported by the caller. When
+ * storing an entry takes the cache over its count or cost limit, entries
+ * are evicted from the least recently used end until it is within both
+ * limits again. An entry which by itself exceeds the cost limit is evicted
+ * at once, rather than flushing the whole cache to make room for it.
+ */
+
+#define LRU_INIT_SIZE 16
+
+struct lru_node {
+  val key, value;
+  cnum cost;
+  cnum prev, next;
+};
+
+struct lru {
+  val table;
+  struct lru_node *node;
+  cnum size;
+  cnum free;
+  cnum count, max_count;
+  cnum cost, max_cost;
+  val evict_fun;
+  ucnum hits, misses, evictions;
+};
+
+val lru_s;
+
+static void lru_init_nodes(struct lru *c, cnum from, cnum to)
+{
+  cnum i;
+
+  for (i = from; i < to; i++) {
+    c->node[i].key = c->node[i].value = nil;
+    c->node[i].cost = 0;
+    c->node[i].prev = 0;
+    c->node[i].next = i + 1 < to ? i + 1 : 0;
+  }
+
+  c->free = from;
+}
+
+static void lru_reset(struct lru *c)
+{
+  c->node = coerce(struct lru_node *,
+                   chk_malloc(LRU_INIT_SIZE * sizeof *c->node));
+  c->size = LRU_INIT_SIZE;
+  c->node[0].key = c->node[0].value = nil;
+  c->node[0].cost = 0;
+  c->node[0].prev = c->node[0].next = 0;
+  lru_init_nodes(c, 1, LRU_INIT_SIZE);
+  c->count = c->cost = 0;
+}
+
+static void lru_reserve(struct lru *c)
+{
+  if (!c->free) {
+    cnum size = c->size * 2;
+
+    if (size <= c->size || size > INT_PTR_MAX / convert(cnum, sizeof *c->node))
+      uw_throwf(error_s, lit("lru-put: cache is too large"), nao);
+
+    c->node = coerce(struct lru_node *,
+                     chk_realloc(coerce(mem_t *, c->node),
+                                 size * sizeof *c->node));
+    lru_init_nodes(c, c->size, size);
+    c->size = size;
+  }
+}
+
+static void lru_unlink(struct lru *c, cnum i)
+{
+  struct lru_node *n = c->node;
+  n[n[i].prev].next = n[i].next;
+  n[n[i].next].prev = n[i].prev;
+}
+
+static void lru_link(struct lru *c, cnum i)
+{
+  struct lru_node *n = c->node;
+  n[i].prev = 0;
+  n[i].next = n[0].next;
+  n[n[0].next].prev = i;
+  n[0].next = i;
+}
+
+static void lru_release(struct lru *c, cnum i)
+{
+  struct lru_node *n = &c->node[i];
+
+  lru_unlink(c, i);
+  c->count--;
+  c->cost -= n->cost;
+  n->key = n->value = nil;
+  n->cost = 0;
+  n->next = c->free;
+  c->free = i;
+}
+
+static int lru_over(struct lru *c)
+{
+  return ((c->max_count >= 0 && c->count > c->max_count) ||
+          (c->max_cost >= 0 && c->cost > c->max_cost));
+}
+
+/*
+ * The eviction function may re-enter the cache, or exit nonlocally, so
+ * the victim is removed before it is called, and nothing about the node
+ * array is assumed afterward.
+ */
+static void lru_evict(struct lru *c)
+{
+  cnum i = c->node[0].prev;
+  val key = c->node[i].key;
+  val value = c->node[i].value;
+
+  remhash(c->table, key);
+  lru_release(c, i);
+  c->evictions++;
+
+  if (c->evict_fun)
+    funcall2(c->evict_fun, key, value);
+}
+
+static void lru_print_op(val cache, val out, val pretty, struct strm_ctx *ctx)
+{
+  struct lru *c = coerce(struct lru *, cache->co.handle);
+
+  put_string(lit("#<lru"), out);
+  format(out, lit(" ~s/~s"), num(c->count),
+         if2(c->max_count >= 0, num(c->max_count)), nao);
+  if (c->max_cost >= 0)
+    format(out, lit(" cost ~s/~s"), num(c->cost), num(c->max_cost), nao);
+  put_char(chr('>'), out);
+}
+
+static void lru_destroy_op(val cache)
+{
+  struct lru *c = coerce(struct lru *, cache->co.handle);
+  free(c->node);
+  c->node = 0;
+  free(c);
+}
+
+static void lru_mark(val cache)
+{
+  struct lru *c = coerce(struct lru *, cache->co.handle);
+  cnum i;
+
+  gc_mark(c->table);
+  gc_mark(c->evict_fun);
+
+  for (i = c->node[0].next; i != 0; i = c->node[i].next) {
+    gc_mark(c->node[i].key);
+    gc_mark(c->node[i].value);
+  }
+}
+
+static struct cobj_ops lru_ops = cobj_ops_init(eq,
+                                               lru_print_op,
+                                               lru_destroy_op,
+                                               lru_mark,
+                                               cobj_eq_hash_op);
+
+static cnum lru_limit(val limit, val what)
+{
+  cnum lim;
+
+  if (null_or_missing_p(limit))
+    return -1;
+
+  if ((lim = c_num(limit)) < 0)
+    uw_throwf(error_s, lit("make-lru: ~a limit ~s is negative"),
+              what, limit, nao);
+
+  return lim;
+}
+
+val make_lru(val max_count, val max_cost, val evict_fun, val equal_based)
+{
+  cnum mcount = lru_limit(max_count, lit("count"));
+  cnum mcost = lru_limit(max_cost, lit("cost"));
+  val table = make_seeded_hash(nil, nil, default_null_arg(equal_based),
+                               colon_k);
+  struct lru *c = coerce(struct lru *, chk_calloc(1, sizeof *c));
+  val cache;
+
+  lru_reset(c);
+  c->max_count = mcount;
+  c->max_cost = mcost;
+  cache = cobj(coerce(mem_t *, c), lru_s, &lru_ops);
+  c->table = table;
+  c->evict_fun = default_null_arg(evict_fun);
+  return cache;
+}
+
+val lrup(val obj)
+{
+  return tnil(typeof(obj) == lru_s);
+}
+
+val lru_get(val cache, val key, val notfound_val)
+{
+  struct lru *c = coerce(struct lru *, cobj_handle(cache, lru_s));
+  val cell = gethash_e(c->table, key);
+
+  if (cell) {
+    cnum i = c_num(cdr(cell));
+    c->hits++;
+    if (c->node[0].next != i) {
+      lru_unlink(c, i);
+      lru_link(c, i);
+    }
+    return c->node[i].value;
+  }
+
+  c->misses++;
+  return default_null_arg(notfound_val);
+}
+
+val lru_put(val cache, val key, val value, val cost)
+{
+  struct lru *c = coerce(struct lru *, cobj_handle(cache, lru_s));
+  cnum cst = if3(missingp(cost), 1, c_num(cost));
+  val new_p, cell;
+  cnum i;
+
+  if (cst < 0)
+    uw_throwf(error_s, lit("lru-put: cost ~s is negative"), cost, nao);
+
+  if (c->max_cost >= 0 && cst > c->max_cost) {
+    lru_del(cache, key);
+    c->evictions++;
+    if (c->evict_fun)
+      funcall2(c->evict_fun, key, value);
+    return value;
+  }
+
+  lru_reserve(c);
+
+  cell = gethash_c(c->table, key, mkcloc(new_p));
+
+  if (new_p) {
+    i = c->free;
+    c->free = c->node[i].next;
+    rplacd(cell, num_fast(i));
+    set(mkloc(c->node[i].key, cache), key);
+    c->count++;
+  } else {
+    i = c_num(cdr(cell));
+    lru_unlink(c, i);
+    c->cost -= c->node[i].cost;
+  }
+
+  set(mkloc(c->node[i].value, cache), value);
+  c->node[i].cost = cst;
+  c->cost += cst;
+  lru_link(c, i);
+
+  while (c->count > 0 && lru_over(c))
+    lru_evict(c);
+
+  gc_hint(cache);
+  return value;
+}
+
+val lru_del(val cache, val key)
+{
+  struct lru *c = coerce(struct lru *, cobj_handle(cache, lru_s));
+  val index = remhash(c->table, key);
+
+  if (index) {
+    cnum i = c_num(index);
+    val value = c->node[i].value;
+    lru_release(c, i);
+    return value;
+  }
+
+  return nil;
+}
+
+val lru_clear(val cache)
+{
+  struct lru *c = coerce(struct lru *, cobj_handle(cache, lru_s));
+  val count = num(c->count);
+  struct lru_node *node = c->node;
+
+  clearhash(c->table);
+  lru_reset(c);
+  free(node);
+  gc_hint(cache);
+  return count;
+}
+
+val lru_count(val cache)
+{
+  struct lru *c = coerce(struct lru *, cobj_handle(cache, lru_s));
+  return num(c->count);
+}
+
+val lru_cost(val cache)
+{
+  struct lru *c = coerce(struct lru *, cobj_handle(cache, lru_s));
+  return num(c->cost);
+}
+
+val lru_keys(val cache)
+{
+  struct lru *c = coerce(struct lru *, cobj_handle(cache, lru_s));
+  list_collect_decl (out, ptail);
+  cnum i;
+
+  for (i = c->node[0].next; i != 0; i = c->node[i].next)
+    ptail = list_collect(ptail, c->node[i].key);
+
+  gc_hint(cache);
+  return out;
+}
+
+val lru_stats(val cache, val reset)
+{
+  struct lru *c = coerce(struct lru *, cobj_handle(cache, lru_s));
+  val stats = list(unum(c->hits), unum(c->misses),
+                   unum(c->evictions), nao);
+
+  if (default_null_arg(reset))
+    c->hits = c->misses = c->evictions = 0;
+
+  gc_hint(cache);
+  return stats;
+}
+
+static val set_hash_str_limit(val lim)
+{
+  val old = num(hash_str_limit);
+  hash_str_limit = c_num(lim);
+  return old;
+}
+
+static val set_hash_rec_limit(val lim)
+{
+  val old = num(hash_rec_limit);
+  hash_rec_limit = c_num(lim);
+  return old;
+}
+
+static val gen_hash_seed(void)
+{
+    val time = time_sec_usec();
+    ucnum sec = convert(ucnum, c_num(car(time)));
+    ucnum usec = convert(ucnum, c_num(cdr(time)));
+#if HAVE_UNISTD_H
+    ucnum pid = convert(ucnum, getpid());
+#else
+    ucnum pid = 0;
+#endif
+    return unum(sec ^ (usec << 12) ^ pid);
+}
+
+void hash_init(void)
+{
+  weak_keys_k = intern(lit("weak-keys"), keyword_package);
+  weak_vals_k = intern(lit("weak-vals"), keyword_package);
+  equal_based_k = intern(lit("equal-based"), keyword_package);
+  eql_based_k = intern(lit("eql-based"), keyword_package);
+  userdata_k = intern(lit("userdata"), keyword_package);
+  hash_seed_s = intern(lit("*hash-seed*"), user_package);
+  hamt_s = intern(lit("hamt"), user_package);
+  lru_s = intern(lit("lru"), user_package);
+  val ghu = func_n1(get_hash_userdata);
+
+  reg_var(hash_seed_s, zero);
+
+  reg_fun(intern(lit("make-hash"), user_package), func_n4o(make_seeded_hash, 3));
+  reg_fun(intern(lit("make-similar-hash"), user_package), func_n1(make_similar_hash));
+  reg_fun(intern(lit("copy-hash"), user_package), func_n1(copy_hash));
+  reg_fun(intern(lit("hash"), user_package), func_n0v(hashv));
+  reg_fun(hash_construct_s, func_n2(hash_construct));
+  reg_fun(intern(lit("hash-from-pairs"), user_package), func_n1v(hash_from_pairs_v));
+  reg_fun(intern(lit("hash-list"), user_package), func_n1v(hash_list));
+  reg_fun(intern(lit("gethash"), user_package), func_n3o(gethash_n, 2));
+  reg_fun(intern(lit("inhash"), user_package), func_n3o(inhash, 2));
+  reg_fun(intern(lit("sethash"), user_package), func_n3(sethash));
+  reg_fun(intern(lit("pushhash"), user_package), func_n3(pushhash));
+  reg_fun(intern(lit("remhash"), user_package), func_n2(remhash));
+  reg_fun(intern(lit("clearhash"), user_package), func_n1(clearhash));
+  reg_fun(intern(lit("hash-count"), user_package), func_n1(hash_count));
+  reg_fun(intern(lit("get-hash-userdata"), user_package), ghu);
+  reg_fun(intern(lit("hash-userdata"), user_package), ghu);
+  reg_fun(intern(lit("set-hash-userdata"), user_package),
+          func_n2(set_hash_userdata));
+  reg_fun(intern(lit("hashp"), user_package), func_n1(hashp));
+  reg_fun(intern(lit("maphash"), user_package), func_n2(maphash));
+  reg_fun(intern(lit("hash-eql"), user_package), func_n1(hash_eql));
+  reg_fun(intern(lit("hash-equal"), user_package), func_n2o(hash_equal, 1));
+  reg_fun(intern(lit("hash-keys"), user_package), func_n1(hash_keys));
+  reg_fun(intern(lit("hash-values"), user_package), func_n1(hash_values));
+  reg_fun(intern(lit("hash-pairs"), user_package), func_n1(hash_pairs));
+  reg_fun(intern(lit("hash-alist"), user_package), func_n1(hash_alist));
+  reg_fun(intern(lit("hash-uni"), user_package), func_n3o(hash_uni, 2));
+  reg_fun(intern(lit("hash-diff"), user_package), func_n2(hash_diff));
+  reg_fun(intern(lit("hash-isec"), user_package), func_n3o(hash_isec, 2));
+  reg_fun(intern(lit("hash-subset"), user_package), func_n2(hash_subset));
+  reg_fun(intern(lit("hash-proper-subset"), user_package), func_n2(hash_proper_subset));
+  reg_fun(intern(lit("group-by"), user_package), func_n2v(group_by));
+  reg_fun(intern(lit("group-reduce"), user_package),
+          func_n6o(group_reduce, 4));
+  reg_fun(intern(lit("hash-update"), user_package), func_n2(hash_update));
+  reg_fun(intern(lit("hash-update-1"), user_package),
+          func_n4o(hash_update_1, 3));
+  reg_fun(intern(lit("hash-revget"), user_package), func_n4o(hash_revget, 2));
+  reg_fun(intern(lit("hash-begin"), user_package), func_n1(hash_begin));
+  reg_fun(intern(lit("hash-next"), user_package), func_n1(hash_next));
+  reg_fun(intern(lit("set-hash-str-limit"), system_package),
+          func_n1(set_hash_str_limit));
+  reg_fun(intern(lit("set-hash-rec-limit"), system_package),
+          func_n1(set_hash_rec_limit));
+  reg_fun(intern(lit("gen-hash-seed"), user_package), func_n0(gen_hash_seed));
+
+  reg_fun(intern(lit("make-hamt"), user_package), func_n2o(make_hamt, 0));
+  reg_fun(intern(lit("hamtp"), user_package), func_n1(hamtp));
+  reg_fun(intern(lit("hamt-count"), user_package), func_n1(hamt_count));
+  reg_fun(intern(lit("hamt-get"), user_package), func_n3o(hamt_get, 2));
+  reg_fun(intern(lit("hamt-in"), user_package), func_n2(hamt_in));
+  reg_fun(intern(lit("hamt-with"), user_package), func_n3(hamt_with));
+  reg_fun(intern(lit("hamt-without"), user_package), func_n2(hamt_without));
+  reg_fun(intern(lit("hamt-from-pairs"), user_package),
+          func_n2o(hamt_from_pairs, 1));
+  reg_fun(intern(lit("hamt-keys"), user_package), func_n1(hamt_keys));
+  reg_fun(intern(lit("hamt-values"), user_package), func_n1(hamt_values));
+  reg_fun(intern(lit("hamt-pairs"), user_package), func_n1(hamt_pairs));
+  reg_fun(intern(lit("hamt-uni"), user_package), func_n3o(hamt_uni, 2));
+  reg_fun(intern(lit("hamt-diff"), user_package), func_n2(hamt_diff));
+  reg_fun(intern(lit("hamt-isec"), user_package), func_n3o(hamt_isec, 2));
+  reg_fun(intern(lit("make-lru"), user_package), func_n4o(make_lru, 1));
+  reg_fun(intern(lit("lrup"), user_package), func_n1(lrup));
+  reg_fun(intern(lit("lru-get"), user_package), func_n3o(lru_get, 2));
+  reg_fun(intern(lit("lru-put"), user_package), func_n4o(lru_put, 3));
+  reg_fun(intern(lit("lru-del"), user_package), func_n2(lru_del));
+  reg_fun(intern(lit("lru-clear"), user_package), func_n1(lru_clear));
+  reg_fun(intern(lit("lru-count"), user_package), func_n1(lru_count));
+  reg_fun(intern(lit("lru-cost"), user_package), func_n1(lru_cost));
+  reg_fun(intern(lit("lru-keys"), user_package), func_n1(lru_keys));
+  reg_fun(intern(lit("lru-stats"), user_package), func_n2o(lru_stats, 1));
 }
@@ -26,6 +26,7 @@
  */
 
 extern val weak_keys_k, weak_vals_k, equal_based_k, eql_based_k, userdata_k;
+extern val hamt_s, lru_s;
 
 ucnum equal_hash(val obj, int *count, ucnum);
 val make_seeded_hash(val weak_keys, val weak_vals, val equal_based, val seed);
@@ -71,6 +72,30 @@ val hash_proper_subset(val hash1, val hash2);
 val hash_update(val hash, val fun);
 val hash_update_1(val hash, val key, val fun, val init);
 val hash_revget(val hash, val value, val test, val keyfun);
+val make_hamt(val equal_based, val seed);
+val hamtp(val obj);
+val hamt_count(val map);
+val hamt_get(val map, val key, val notfound_val);
+val hamt_in(val map, val key);
+val hamt_with(val map, val key, val value);
+val hamt_without(val map, val key);
+val hamt_from_pairs(val pairs, val equal_based);
+val hamt_keys(val map);
+val hamt_values(val map);
+val hamt_pairs(val map);
+val hamt_uni(val map1, val map2, val join_func);
+val hamt_diff(val map1, val map2);
+val hamt_isec(val map1, val map2, val join_func);
+val make_lru(val max_count, val max_cost, val evict_fun, val equal_based);
+val lrup(val obj);
+val lru_get(val cache, val key, val notfound_val);
+val lru_put(val cache, val key, val value, val cost);
+val lru_del(val cache, val key);
+val lru_clear(val cache);
+val lru_count(val cache);
+val lru_cost(val cache);
+val lru_keys(val cache);
+val lru_stats(val cache, val reset);
 
 void hash_process_weak(void);
 
@@ -60,6 +60,7 @@
 #include "filter.h"
 #include "eval.h"
 #include "vm.h"
+#include "tlo.h"
 #include "sysif.h"
 #include "regex.h"
 #include "parser.h"
@@ -138,6 +139,12 @@ int is_ptr(val obj);
 int is_num(val obj);
 int is_chr(val obj);
 int is_lit(val obj);
+#if CONFIG_IMM_FLOAT
+int is_flo_imm(val obj);
+#endif
+#if CONFIG_COMPACT_CONS
+int is_compact_cons(val obj);
+#endif
 type_t type(val obj);
 val auto_str(const wchli_t *str);
 val static_str(const wchli_t *str);
@@ -331,7 +338,9 @@ val throw_mismatch(val obj, type_t t)
 
 val type_check2(val obj, int t1, int t2)
 {
-  if (!is_ptr(obj) || (obj->t.type != t1 && obj->t.type != t2))
+  type_t ty = type(obj);
+
+  if (!is_ptr(obj) || (ty != t1 && ty != t2))
     type_mismatch(lit("~s is not of type ~s or ~s"), obj,
                   code2type(t1), code2type(t2), nao);
   return t;
@@ -339,8 +348,9 @@ val type_check2(val obj, int t1, int t2)
 
 val type_check3(val obj, int t1, int t2, int t3)
 {
-  if (!is_ptr(obj) || (obj->t.type != t1 && obj->t.type != t2
-                       && obj->t.type != t3))
+  type_t ty = type(obj);
+
+  if (!is_ptr(obj) || (ty != t1 && ty != t2 && ty != t3))
     type_mismatch(lit("~s is not of type ~s, ~s nor ~s"), obj,
                   code2type(t1), code2type(t2), code2type(t3), nao);
   return t;
@@ -348,7 +358,7 @@ val type_check3(val obj, int t1, int t2, int t3)
 
 val class_check(val cobj, val class_sym)
 {
-  type_assert (is_ptr(cobj) && cobj->t.type == COBJ &&
+  type_assert (type(cobj) == COBJ &&
               (cobj->co.cls == class_sym || subtypep(cobj->co.cls, class_sym)),
                (lit("~s is not of type ~s"), cobj, class_sym, nao));
   return t;
@@ -2618,7 +2628,7 @@ val equal(val left, val right)
     break;
   case FLNUM:
     if (type(right) == FLNUM) {
-      if (left->fl.n == right->fl.n)
+      if (c_flo(left) == c_flo(right))
         return t;
       return nil;
     }
@@ -2861,8 +2871,7 @@ val cons(val car, val cdr)
     gc_mutated(obj);
 #endif
   } else {
-    obj = make_obj();
-    obj->c.type = CONS;
+    obj = make_cons_obj();
   }
 
   obj->c.car = car;
@@ -3146,9 +3155,72 @@ cnum c_fixnum(val num, val self)
   }
 }
 
+#if CONFIG_IMM_FLOAT
+
+/*
+ * Immediate floats. The bits of a double are rotated left by four, which
+ * brings the sign and the top three bits of the exponent to the bottom.
+ * Those three exponent bits are dropped, to make room for the tag, so only
+ * a double with an exponent within 128 of the bias can be encoded: then,
+ * the dropped bits are all the complement of the exponent bit which now
+ * occupies the top, and are restored from it. Positive zero is encoded
+ * specially. The rest of the bits are scrambled with FLO_IMM_KEY, so that
+ * the two values thereby taken away from the encoding, the one which
+ * would coincide with nao and the one which stands for zero, are obscure.
+ */
+#define FLO_IMM_KEY ((convert(ucnum, 0x80123456) << 32) | 0x789ABCD0)
+#define FLO_IMM_ZERO coerce(val, 8 | FLO_IMM_TAG)
+
+static val flo_imm(double n)
+{
+  ucnum bits, x, v;
+
+  memcpy(&bits, &n, sizeof bits);
+
+  if (bits == 0)
+    return FLO_IMM_ZERO;
+
+  x = (bits << 4) | (bits >> 60);
+
+  if ((x & 7) != if3(x >> 63, 3, 4))
+    return nil;
+
+  v = (x & ~convert(ucnum, 7)) ^ FLO_IMM_KEY;
+
+  if (v == 0 || v == 8)
+    return nil;
+
+  return coerce(val, v | FLO_IMM_TAG);
+}
+
+static double flo_imm_val(val obj)
+{
+  ucnum v = coerce(ucnum, obj) & ~convert(ucnum, 7), x, bits;
+  double n;
+
+  if (v == 8)
+    return 0.0;
+
+  x = v ^ FLO_IMM_KEY;
+  x |= if3(x >> 63, 3, 4);
+  bits = (x >> 4) | (x << 60);
+
+  memcpy(&n, &bits, sizeof n);
+  return n;
+}
+
+#endif
+
 val flo(double n)
 {
-  val obj = make_obj();
+  val obj;
+
+#if CONFIG_IMM_FLOAT
+  if ((obj = flo_imm(n)) != nil)
+    return obj;
+#endif
+
+  obj = make_obj();
   obj->fl.type = FLNUM;
   obj->fl.n = n;
   return obj;
@@ -3157,6 +3229,10 @@ val flo(double n)
 double c_flo(val num)
 {
   type_check(num, FLNUM);
+#if CONFIG_IMM_FLOAT
+  if (is_flo_imm(num))
+    return flo_imm_val(num);
+#endif
   return num->fl.n;
 }
 
@@ -3178,7 +3254,7 @@ val integerp(val num)
   case TAG_PTR:
     if (num == nil)
       return nil;
-    if (num->t.type == BGNUM)
+    if (type(num) == BGNUM)
       return t;
     /* fallthrough */
   default:
@@ -3199,7 +3275,7 @@ val numberp(val num)
   case TAG_PTR:
     if (num == nil)
       return nil;
-    if (num->t.type == BGNUM || num->t.type == FLNUM)
+    if (type(num) == BGNUM || type(num) == FLNUM)
       return t;
     /* fallthrough */
   default:
@@ -3504,12 +3580,19 @@ val lcmv(struct args *nlist)
   return nary_op(lit("lcm"), lcm, abso_self, nlist, zero);
 }
 
+#if STR_HASH_CACHE
+#define str_hash_reset(str) ((str)->st.hash = 0)
+#else
+#define str_hash_reset(str) ((void) 0)
+#endif
+
 val string_own(wchar_t *str)
 {
   val obj = make_obj();
   obj->st.type = STR;
   obj->st.str = str;
   obj->st.len = nil;
+  str_hash_reset(obj);
   obj->st.alloc = nil;
   return obj;
 }
@@ -3520,6 +3603,7 @@ val string(const wchar_t *str)
   obj->st.type = STR;
   obj->st.str = coerce(wchar_t *, chk_strdup(str));
   obj->st.len = nil;
+  str_hash_reset(obj);
   obj->st.alloc = nil;
   return obj;
 }
@@ -3530,6 +3614,7 @@ val string_utf8(const char *str)
   obj->st.type = STR;
   obj->st.str = utf8_dup_from(str);
   obj->st.len = nil;
+  str_hash_reset(obj);
   obj->st.alloc = nil;
   return obj;
 }
@@ -3647,6 +3732,8 @@ val string_extend(val str, val tail)
 
     needed = len + delta + 1;
 
+    str_hash_reset(str);
+
     if (needed > alloc) {
       if (alloc >= (NUM_MAX - NUM_MAX / 5))
         alloc = NUM_MAX;
@@ -4027,6 +4114,8 @@ val replace_str(val str_in, val items, val from, val to)
     val len_rep = minus(to, from);
     val len_it = length(itseq);
 
+    str_hash_reset(str_in);
+
     if (gt(len_rep, len_it)) {
       val len_diff = minus(len_rep, len_it);
       cnum t = c_num(to);
@@ -5076,8 +5165,10 @@ val chr_str_set(val str, val ind, val chr)
 
   if (lazy_stringp(str)) {
     lazy_str_force_upto(str, ind);
+    str_hash_reset(str->ls.prefix);
     str->ls.prefix->st.str[index] = c_chr(chr);
   } else {
+    str_hash_reset(str);
     str->st.str[index] = c_chr(chr);
   }
 
@@ -12043,6 +12134,7 @@ void init(val *stack_bottom)
   stream_init();
   strudel_init();
   vm_init();
+  tlo_init();
 #if HAVE_POSIX_SIGS
   sig_init();
 #endif
@@ -88,8 +88,9 @@ typedef unsigned char mem_t;
 
 #if CONFIG_GEN_GC
 #define obj_common \
-  type_t type : PTR_BIT/2; \
-  int gen : PTR_BIT/2
+  type_t type : 16; \
+  int gen : 8; \
+  unsigned int mark : 8
 #else
 #define obj_common \
   type_t type
@@ -101,19 +102,42 @@ struct any {
   val next; /* GC free list */
 };
 
+/*
+ * With CONFIG_COMPACT_CONS, conses made by cons are allocated as two-word
+ * cells in separate heaps, which keep the headers aside. The value of
+ * such a cons points CONS_BIAS bytes below its cell, where the car
+ * would be found in a full-sized object, so that car and cdr are
+ * accessed in the same way. All other objects are aligned such that
+ * this bit is clear in their address.
+ */
 struct cons {
   obj_common;
   val car, cdr;
 };
 
+#if CONFIG_COMPACT_CONS
+#define CONS_BIAS SIZEOF_PTR
+#endif
+
 struct cons_hash_entry {
   obj_common;
   val car, cdr;
   cnum hash;
 };
 
+/*
+ * On 64 bit targets, the header word has room left over after
+ * obj_common, which strings use to cache their equal hash.
+ */
+#if SIZEOF_PTR >= 8
+#define STR_HASH_CACHE 1
+#endif
+
 struct string {
   obj_common;
+#if STR_HASH_CACHE
+  unsigned hash;
+#endif
   wchar_t *str;
   val len;
   val alloc;
@@ -280,11 +304,22 @@ struct bignum {
   mp_int mp;
 };
 
+/*
+ * With CONFIG_IMM_FLOAT, a floating-point value is not allocated on
+ * the heap if it can be encoded in the value itself; see flo in lib.c.
+ * Such a value has the pointer tag, together with the FLO_IMM_TAG bit,
+ * which is clear in the address of every object. The value nao has
+ * this bit pattern too, and is distinguished from an immediate float.
+ */
 struct flonum {
   obj_common;
   double n;
 };
 
+#if CONFIG_IMM_FLOAT
+#define FLO_IMM_TAG 4
+#endif
+
 struct range {
   obj_common;
   val from, to;
@@ -367,18 +402,47 @@ extern const seq_kind_t seq_kind_tab[MAXTYPE+1];
 #define SEQ_KIND_PAIR(A, B) ((A) << 3 | (B))
 
 INLINE cnum tag(val obj) { return coerce(cnum, obj) & TAG_MASK; }
+#if CONFIG_IMM_FLOAT
+INLINE int is_flo_imm(val obj)
+{
+  cnum bits = coerce(cnum, obj);
+  return (bits & (FLO_IMM_TAG | TAG_MASK)) == FLO_IMM_TAG && bits != FLO_IMM_TAG;
+}
+INLINE int is_ptr(val obj)
+{
+  return obj && tag(obj) == TAG_PTR && !is_flo_imm(obj);
+}
+#else
 INLINE int is_ptr(val obj) { return obj && tag(obj) == TAG_PTR; }
+#endif
 INLINE int is_num(val obj) { return tag(obj) == TAG_NUM; }
 INLINE int is_chr(val obj) { return tag(obj) == TAG_CHR; }
 INLINE int is_lit(val obj) { return tag(obj) == TAG_LIT; }
 
+#if CONFIG_COMPACT_CONS
+INLINE int is_compact_cons(val obj)
+{
+  return (coerce(cnum, obj) & (2 * CONS_BIAS - 1)) == CONS_BIAS;
+}
+#endif
+
 INLINE type_t type(val obj)
 {
   cnum tg = tag(obj);
-  return obj ? tg
-               ? convert(type_t, tg)
-               : obj->t.type
-             : NIL;
+
+  if (tg)
+    return convert(type_t, tg);
+  if (!obj)
+    return NIL;
+#if CONFIG_IMM_FLOAT
+  if (is_flo_imm(obj))
+    return FLNUM;
+#endif
+#if CONFIG_COMPACT_CONS
+  if (is_compact_cons(obj))
+    return CONS;
+#endif
+  return obj->t.type;
 }
 
 typedef struct wli wchli_t;
@@ -706,7 +706,8 @@ static val compiler_set_entries(val dlt, val fun)
   };
   val name[] = {
     lit("compile-toplevel"), lit("compile-file"), lit("compile"),
-    lit("with-compilation-unit"),
+    lit("with-compilation-unit"), lit("*compile-file-format*"),
+    lit("*opt-level*"), lit("*opt-report*"),
     nil
   };
 
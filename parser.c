@@ -60,6 +60,7 @@
 #include "itypes.h"
 #include "buf.h"
 #include "vm.h"
+#include "tlo.h"
 #include "txr.h"
 #if HAVE_TERMIOS
 #include "linenoise/linenoise.h"
@@ -636,7 +637,7 @@ static val read_file_common(val stream, val error_stream, val compiled)
 
     if (compiled && first) {
       val major = car(form);
-      if (lt(major, one) || gt(major, two))
+      if (lt(major, one) || gt(major, num_fast(TLO_TEXT_MAJOR)))
         uw_throwf(error_s,
                   lit("cannot load ~s: version number mismatch"),
                   stream, nao);
@@ -650,10 +651,11 @@ static val read_file_common(val stream, val error_stream, val compiled)
         val bytecode = pop(&item);
         val datavec = pop(&item);
         val funvec = car(item);
-        val desc = vm_make_desc(nlevels, nregs, bytecode, datavec, funvec);
+        val desc;
         if ((big_endian && itypes_little_endian) ||
             (!big_endian && !itypes_little_endian))
           buf_swap32(bytecode);
+        desc = vm_make_desc(nlevels, nregs, bytecode, datavec, funvec);
         (void) vm_execute_toplevel(desc);
         gc_hint(desc);
       }
@@ -675,6 +677,8 @@ val read_eval_stream(val stream, val error_stream)
 
 val read_compiled_file(val stream, val error_stream)
 {
+  if (tlo_load(stream))
+    return t;
   return read_file_common(stream, error_stream, t);
 }
 
@@ -1562,6 +1566,8 @@ void parse_init(void)
   reg_var(listener_pprint_s, nil);
   reg_var(listener_greedy_eval_s, nil);
   reg_var(rec_source_loc_s, nil);
+  reg_varl(intern(lit("%tlo-major%"), system_package),
+           num_fast(TLO_TEXT_MAJOR));
   reg_fun(circref_s, func_n1(circref));
   reg_fun(intern(lit("get-parser"), system_package), func_n1(get_parser));
   reg_fun(intern(lit("parser-errors"), system_package), func_n1(parser_errors));
@@ -69,6 +69,10 @@ struct parser {
 
 enum prime_parser { prime_lisp, prime_interactive, prime_regex };
 
+/* Major version of text compiled files; the compiler's %tlo-ver%
+   takes it from the variable sys:%tlo-major%. */
+#define TLO_TEXT_MAJOR 3
+
 extern const int have_yydebug;
 extern const wchar_t *spec_file;
 extern val form_to_ln_hash;
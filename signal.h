@@ -37,9 +37,15 @@ extern int debug_depth;
 #define EJ_DBG_REST(EJB)
 #endif
 
-#define EJ_OPT_MEMB EJ_DBG_MEMB
-#define EJ_OPT_SAVE(EJB) EJ_DBG_SAVE(EJB)
-#define EJ_OPT_REST(EJB) EJ_DBG_REST(EJB)
+struct vm;
+extern struct vm *vm_top;
+#define EJ_VM_MEMB struct vm *volatile vm_top;
+#define EJ_VM_SAVE(EJB) (EJB).vm_top = vm_top,
+#define EJ_VM_REST(EJB) vm_top = (EJB).vm_top,
+
+#define EJ_OPT_MEMB EJ_DBG_MEMB EJ_VM_MEMB
+#define EJ_OPT_SAVE(EJB) EJ_DBG_SAVE(EJB) EJ_VM_SAVE(EJB)
+#define EJ_OPT_REST(EJB) EJ_DBG_REST(EJB) EJ_VM_REST(EJB)
 
 #if __i386__
 
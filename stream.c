@@ -3344,7 +3344,7 @@ val formatv(val stream_in, val fmtstr, struct args *al)
               uw_throwf(error_s, lit("excessive precision in format: ~s"),
                         num(precision), nao);
 
-            sprintf(num_buf, "%.*g", precision, obj->fl.n);
+            sprintf(num_buf, "%.*g", precision, c_flo(obj));
 
             {
               char *dec = strchr(num_buf, '.');
@@ -0,0 +1,639 @@
+/* Copyright 2018
+ * Kaz Kylheku <kaz@kylheku.com>
+ * Vancouver, Canada
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wchar.h>
+#include <stdarg.h>
+#include <signal.h>
+#include <limits.h>
+#include <dirent.h>
+#include "config.h"
+#include "lib.h"
+#include "eval.h"
+#include "gc.h"
+#include "hash.h"
+#include "signal.h"
+#include "unwind.h"
+#include "stream.h"
+#include "utf8.h"
+#include "cadr.h"
+#include "arith.h"
+#include "itypes.h"
+#include "buf.h"
+#include "parser.h"
+#include "vm.h"
+#include "tlo.h"
+
+/*
+ * Binary compiled file layout. Every field is a 32 bit word in the
+ * byte order of the machine which wrote the file; the byte order mark
+ * tells the loader whether to swap.
+ *
+ *   header:  magic, byte order mark, major, minor,
+ *            form count, pool count, pool table offset, text offset
+ *   forms:   nlevels, nregs, code offset, code size,
+ *            data count, symbol count, data indices, symbol indices
+ *   code:    the bytecode of each form, word aligned
+ *   table:   pool entry offsets, relative to the end of the table
+ *   entries: tag word, followed by the tag-specific payload
+ *   text:    the printed vector of the objects which have no binary
+ *            pool representation, relative to the end of the table
+ *
+ * The file is read into memory, and the code of each form is copied out
+ * of it, so that a compiled file may be rewritten while the functions
+ * loaded from it are in use. Objects without a binary representation are
+ * printed together, as one vector, so that structure shared among them
+ * is preserved under *print-circle*; their pool entries give their
+ * position in that vector.
+ */
+
+#define TLO_MAGIC "\177TLO"
+#define TLO_BOM 0x01020304
+#define TLO_MAJOR 4
+#define TLO_MINOR 0
+#define TLO_HDR_SIZE (8 * 4)
+#define TLO_FORM_SIZE (6 * 4)
+#define TLO_NONE 0xFFFFFFFF
+
+enum tlo_tag {
+  TLO_INT = 1, TLO_CHR, TLO_STR, TLO_SYM, TLO_FLO, TLO_BIG,
+  TLO_CONS, TLO_VEC, TLO_TEXT
+};
+
+struct tlo_buf {
+  mem_t *data;
+  ucnum fill, size;
+};
+
+struct tlo_pool {
+  val hash;
+  val vec;
+  val texts;
+};
+
+struct tlo_in {
+  mem_t *data;
+  ucnum size;
+  int swap;
+  val name;
+};
+
+static void tlo_put(struct tlo_buf *tb, const void *ptr, ucnum size)
+{
+  if (tb->size - tb->fill < size) {
+    ucnum nsize = tb->size ? tb->size : 256;
+    while (nsize - tb->fill < size)
+      nsize *= 2;
+    tb->data = chk_realloc(tb->data, nsize);
+    tb->size = nsize;
+  }
+
+  memcpy(tb->data + tb->fill, ptr, size);
+  tb->fill += size;
+}
+
+static void tlo_put_word(struct tlo_buf *tb, ucnum word)
+{
+  u32_t w = word;
+  tlo_put(tb, &w, sizeof w);
+}
+
+static void tlo_put_utf8(struct tlo_buf *tb, const wchar_t *str)
+{
+  static const char pad[4];
+  char *u8 = utf8_dup_to(str);
+  size_t len = strlen(u8);
+
+  tlo_put_word(tb, len);
+  tlo_put(tb, u8, len);
+  tlo_put(tb, pad, 4 - len % 4);
+  free(u8);
+}
+
+static void tlo_emit(struct tlo_buf *tb, val stream)
+{
+  if (tb->fill)
+    put_buf(make_borrowed_buf(unum(tb->fill), tb->data), zero, stream);
+  free(tb->data);
+  tb->data = 0;
+}
+
+static ucnum tlo_index(struct tlo_pool *tp, val obj)
+{
+  val new_p;
+  val cell = gethash_c(tp->hash, obj, mkcloc(new_p));
+
+  if (new_p)
+    rplacd(cell, vec_push(tp->vec, obj));
+
+  return c_num(cdr(cell));
+}
+
+static void tlo_put_obj(struct tlo_buf *tb, struct tlo_pool *tp, val obj)
+{
+  switch (type(obj)) {
+  case NIL:
+  case SYM:
+    {
+      val package = symbol_package(obj);
+      ucnum pidx = if3(package, tlo_index(tp, package_name(package)),
+                       TLO_NONE);
+      ucnum nidx = tlo_index(tp, symbol_name(obj));
+      tlo_put_word(tb, TLO_SYM);
+      tlo_put_word(tb, pidx);
+      tlo_put_word(tb, nidx);
+    }
+    return;
+  case NUM:
+    {
+      cnum n = c_num(obj);
+      if (n >= -convert(cnum, 0x7FFFFFFF) - 1 && n <= 0x7FFFFFFF) {
+        tlo_put_word(tb, TLO_INT);
+        tlo_put_word(tb, n);
+        return;
+      }
+    }
+    /* fallthrough */
+  case BGNUM:
+    tlo_put_word(tb, TLO_BIG);
+    tlo_put_utf8(tb, c_str(tostring(obj)));
+    return;
+  case CHR:
+    tlo_put_word(tb, TLO_CHR);
+    tlo_put_word(tb, c_chr(obj));
+    return;
+  case LIT:
+  case STR:
+  case LSTR:
+    {
+      const wchar_t *str = c_str(obj);
+      if (wcschr(str, 0xDC00))
+        break;
+      tlo_put_word(tb, TLO_STR);
+      tlo_put_utf8(tb, str);
+    }
+    return;
+  case FLNUM:
+    {
+      double d = c_flo(obj);
+      tlo_put_word(tb, TLO_FLO);
+      tlo_put(tb, &d, sizeof d);
+    }
+    return;
+  case CONS:
+  case LCONS:
+    {
+      ucnum aidx = tlo_index(tp, car(obj));
+      ucnum didx = tlo_index(tp, cdr(obj));
+      tlo_put_word(tb, TLO_CONS);
+      tlo_put_word(tb, aidx);
+      tlo_put_word(tb, didx);
+    }
+    return;
+  case VEC:
+    {
+      cnum i, n = c_num(length_vec(obj));
+      tlo_put_word(tb, TLO_VEC);
+      tlo_put_word(tb, n);
+      for (i = 0; i < n; i++)
+        tlo_put_word(tb, tlo_index(tp, obj->v.vec[i]));
+    }
+    return;
+  default:
+    break;
+  }
+
+  tlo_put_word(tb, TLO_TEXT);
+  tlo_put_word(tb, c_num(vec_push(tp->texts, obj)));
+}
+
+val tlo_write(val forms, val stream)
+{
+  val self = lit("sys:tlo-write");
+  struct tlo_buf head = { 0 }, recs = { 0 }, code = { 0 };
+  struct tlo_buf tab = { 0 }, ents = { 0 };
+  struct tlo_pool tp;
+  ucnum code_base = TLO_HDR_SIZE, nforms = 0, i, text_off = TLO_NONE;
+  val iter;
+
+  tp.hash = make_hash(nil, nil, nil);
+  tp.vec = vector(zero, nil);
+  tp.texts = vector(zero, nil);
+
+  for (iter = forms; iter; iter = cdr(iter)) {
+    val form = cdddr(car(iter));
+    val datavec = pop(&form);
+    val symvec = car(form);
+    code_base += TLO_FORM_SIZE;
+    code_base += 4 * c_num(length_vec(datavec));
+    code_base += 4 * c_num(length_vec(symvec));
+    nforms++;
+  }
+
+  for (iter = forms; iter; iter = cdr(iter)) {
+    val form = car(iter);
+    val nlevels = pop(&form);
+    val nregs = pop(&form);
+    val bytecode = pop(&form);
+    val datavec = pop(&form);
+    val symvec = car(form);
+    cnum len = c_num(length_buf(bytecode));
+    cnum ndata = c_num(length_vec(datavec));
+    cnum nsym = c_num(length_vec(symvec));
+    cnum j;
+
+    tlo_put_word(&recs, c_num(nlevels));
+    tlo_put_word(&recs, c_num(nregs));
+    tlo_put_word(&recs, code_base + code.fill);
+    tlo_put_word(&recs, len);
+    tlo_put_word(&recs, ndata);
+    tlo_put_word(&recs, nsym);
+
+    for (j = 0; j < ndata; j++)
+      tlo_put_word(&recs, tlo_index(&tp, datavec->v.vec[j]));
+    for (j = 0; j < nsym; j++)
+      tlo_put_word(&recs, tlo_index(&tp, symvec->v.vec[j]));
+
+    tlo_put(&code, buf_get(bytecode, self), len);
+  }
+
+  for (i = 0; i < convert(ucnum, c_num(length_vec(tp.vec))); i++) {
+    tlo_put_word(&tab, ents.fill);
+    tlo_put_obj(&ents, &tp, tp.vec->v.vec[i]);
+  }
+
+  if (length_vec(tp.texts) != zero) {
+    text_off = ents.fill;
+    tlo_put_utf8(&ents, c_str(tostring(tp.texts)));
+  }
+
+  tlo_put(&head, TLO_MAGIC, 4);
+  tlo_put_word(&head, TLO_BOM);
+  tlo_put_word(&head, TLO_MAJOR);
+  tlo_put_word(&head, TLO_MINOR);
+  tlo_put_word(&head, nforms);
+  tlo_put_word(&head, i);
+  tlo_put_word(&head, code_base + code.fill);
+  tlo_put_word(&head, text_off);
+
+  tlo_emit(&head, stream);
+  tlo_emit(&recs, stream);
+  tlo_emit(&code, stream);
+  tlo_emit(&tab, stream);
+  tlo_emit(&ents, stream);
+
+  return t;
+}
+
+static noreturn void tlo_corrupt(struct tlo_in *ti)
+{
+  uw_throwf(error_s, lit("cannot load ~a: corrupt compiled file"),
+            ti->name, nao);
+}
+
+static u32_t tlo_word(struct tlo_in *ti, ucnum off)
+{
+  u32_t w;
+
+  if (off % 4 != 0 || off >= ti->size || ti->size - off < sizeof w)
+    tlo_corrupt(ti);
+
+  memcpy(&w, ti->data + off, sizeof w);
+
+  if (ti->swap)
+    w = ((w & 0xFF) << 24) | ((w & 0xFF00) << 8) |
+        ((w >> 8) & 0xFF00) | ((w >> 24) & 0xFF);
+
+  return w;
+}
+
+static val tlo_str(struct tlo_in *ti, ucnum off)
+{
+  ucnum len = tlo_word(ti, off);
+
+  off += 4;
+
+  if (len >= ti->size - off || ti->data[off + len] != 0)
+    tlo_corrupt(ti);
+
+  return string_utf8(coerce(const char *, ti->data + off));
+}
+
+static double tlo_double(struct tlo_in *ti, ucnum off)
+{
+  double d;
+  mem_t *p = coerce(mem_t *, &d);
+
+  if (off >= ti->size || ti->size - off < sizeof d)
+    tlo_corrupt(ti);
+
+  memcpy(&d, ti->data + off, sizeof d);
+
+  if (ti->swap) {
+    size_t i;
+    for (i = 0; i < sizeof d / 2; i++) {
+      mem_t b = p[i];
+      p[i] = p[sizeof d - i - 1];
+      p[sizeof d - i - 1] = b;
+    }
+  }
+
+  return d;
+}
+
+static val tlo_text(struct tlo_in *ti, ucnum off)
+{
+  val obj = lisp_parse(tlo_str(ti, off), std_error, colon_k, ti->name, one);
+
+  if (obj == colon_k)
+    tlo_corrupt(ti);
+
+  return obj;
+}
+
+static val tlo_ref(struct tlo_in *ti, val pool, ucnum idx)
+{
+  if (idx >= convert(ucnum, c_num(length_vec(pool))))
+    tlo_corrupt(ti);
+  return pool->v.vec[idx];
+}
+
+static val tlo_load_pool(struct tlo_in *ti, ucnum npool, ucnum tab,
+                         ucnum text_off)
+{
+  ucnum ents = tab + 4 * npool, i;
+  int pass;
+  val pool, texts = nil;
+
+  if (npool > ti->size / 4 || tab > ti->size || ents > ti->size)
+    tlo_corrupt(ti);
+
+  if (text_off != TLO_NONE) {
+    if (text_off > ti->size - ents)
+      tlo_corrupt(ti);
+    texts = tlo_text(ti, ents + text_off);
+    if (!vectorp(texts))
+      tlo_corrupt(ti);
+  }
+
+  pool = vector(unum(npool), nil);
+
+  /*
+   * Pass 0 makes atoms and empty aggregates, pass 1 interns
+   * symbols, whose names are string entries, and pass 2 fills in
+   * the aggregates, whose elements may refer to any entry.
+   */
+  for (pass = 0; pass < 3; pass++) {
+    for (i = 0; i < npool; i++) {
+      ucnum off = ents + tlo_word(ti, tab + 4 * i);
+      u32_t tag = tlo_word(ti, off);
+      loc ploc = mkloc(pool->v.vec[i], pool);
+
+      switch (tag) {
+      case TLO_INT:
+        if (pass == 0) {
+          u32_t w = tlo_word(ti, off + 4);
+          cnum n = if3(w & 0x80000000,
+                       -convert(cnum, ~w & 0xFFFFFFFF) - 1,
+                       convert(cnum, w));
+          set(ploc, num(n));
+        }
+        break;
+      case TLO_CHR:
+        if (pass == 0)
+          set(ploc, chr(tlo_word(ti, off + 4)));
+        break;
+      case TLO_STR:
+        if (pass == 0)
+          set(ploc, tlo_str(ti, off + 4));
+        break;
+      case TLO_FLO:
+        if (pass == 0)
+          set(ploc, flo(tlo_double(ti, off + 4)));
+        break;
+      case TLO_BIG:
+        if (pass == 0) {
+          val n = int_str(tlo_str(ti, off + 4), nil);
+          if (!n)
+            tlo_corrupt(ti);
+          set(ploc, n);
+        }
+        break;
+      case TLO_TEXT:
+        if (!texts)
+          tlo_corrupt(ti);
+        if (pass == 0)
+          set(ploc, tlo_ref(ti, texts, tlo_word(ti, off + 4)));
+        break;
+      case TLO_SYM:
+        if (pass == 1) {
+          u32_t pidx = tlo_word(ti, off + 4);
+          val name = tlo_ref(ti, pool, tlo_word(ti, off + 8));
+
+          if (!stringp(name))
+            tlo_corrupt(ti);
+
+          if (pidx == TLO_NONE) {
+            set(ploc, make_sym(name));
+          } else {
+            val pname = tlo_ref(ti, pool, pidx);
+            val package = if2(stringp(pname), find_package(pname));
+
+            if (!package)
+              uw_throwf(error_s, lit("cannot load ~a: no package ~s"),
+                        ti->name, pname, nao);
+
+            set(ploc, intern(name, package));
+          }
+        }
+        break;
+      case TLO_CONS:
+        if (pass == 0) {
+          set(ploc, cons(nil, nil));
+        } else if (pass == 2) {
+          val cell = pool->v.vec[i];
+          rplaca(cell, tlo_ref(ti, pool, tlo_word(ti, off + 4)));
+          rplacd(cell, tlo_ref(ti, pool, tlo_word(ti, off + 8)));
+        }
+        break;
+      case TLO_VEC:
+        {
+          ucnum n = tlo_word(ti, off + 4), j;
+
+          if (n > ti->size / 4)
+            tlo_corrupt(ti);
+
+          if (pass == 0) {
+            set(ploc, vector(unum(n), nil));
+          } else if (pass == 2) {
+            val vec = pool->v.vec[i];
+            for (j = 0; j < n; j++) {
+              val elem = tlo_ref(ti, pool, tlo_word(ti, off + 8 + 4 * j));
+              set(mkloc(vec->v.vec[j], vec), elem);
+            }
+          }
+        }
+        break;
+      default:
+        tlo_corrupt(ti);
+      }
+    }
+  }
+
+  return pool;
+}
+
+static void tlo_load_forms(struct tlo_in *ti, val pool, ucnum nforms)
+{
+  ucnum off = TLO_HDR_SIZE, i;
+
+  for (i = 0; i < nforms; i++) {
+    ucnum nlevels = tlo_word(ti, off);
+    ucnum nregs = tlo_word(ti, off + 4);
+    ucnum coff = tlo_word(ti, off + 8);
+    ucnum clen = tlo_word(ti, off + 12);
+    ucnum ndata = tlo_word(ti, off + 16);
+    ucnum nsym = tlo_word(ti, off + 20);
+    val bytecode, datavec, symvec, desc;
+    ucnum j;
+
+    off += TLO_FORM_SIZE;
+
+    if (coff % 4 != 0 || clen % 4 != 0 ||
+        coff > ti->size || clen > ti->size - coff ||
+        ndata > ti->size / 4 || nsym > ti->size / 4)
+      tlo_corrupt(ti);
+
+    bytecode = make_duplicate_buf(unum(clen), ti->data + coff);
+
+    if (ti->swap)
+      buf_swap32(bytecode);
+
+    datavec = vector(unum(ndata), nil);
+    symvec = vector(unum(nsym), nil);
+
+    for (j = 0; j < ndata; j++, off += 4)
+      set(mkloc(datavec->v.vec[j], datavec),
+          tlo_ref(ti, pool, tlo_word(ti, off)));
+
+    for (j = 0; j < nsym; j++, off += 4)
+      set(mkloc(symvec->v.vec[j], symvec),
+          tlo_ref(ti, pool, tlo_word(ti, off)));
+
+    desc = vm_make_desc(unum(nlevels), unum(nregs),
+                        bytecode, datavec, symvec);
+    (void) vm_execute_toplevel(desc);
+    gc_hint(desc);
+  }
+}
+
+static void tlo_check_bom(struct tlo_in *ti)
+{
+  switch (tlo_word(ti, 4)) {
+  case TLO_BOM:
+    break;
+  default:
+    ti->swap = 1;
+    if (tlo_word(ti, 4) == TLO_BOM)
+      break;
+    tlo_corrupt(ti);
+  }
+}
+
+static void tlo_load_unit(struct tlo_in *ti)
+{
+  val pool;
+
+  if (ti->size < TLO_HDR_SIZE || memcmp(ti->data, TLO_MAGIC, 4) != 0)
+    tlo_corrupt(ti);
+
+  tlo_check_bom(ti);
+
+  if (tlo_word(ti, 8) != TLO_MAJOR)
+    uw_throwf(error_s, lit("cannot load ~a: version number mismatch"),
+              ti->name, nao);
+
+  pool = tlo_load_pool(ti, tlo_word(ti, 20), tlo_word(ti, 24),
+                       tlo_word(ti, 28));
+  tlo_load_forms(ti, pool, tlo_word(ti, 16));
+}
+
+static val tlo_slurp(val stream, val buf, val len)
+{
+  for (;;) {
+    val nlen = fill_buf(buf, len, stream);
+    if (nlen != length_buf(buf)) {
+      len = nlen;
+      break;
+    }
+    len = nlen;
+    buf_set_length(buf, mul(len, two), zero);
+  }
+
+  buf_set_length(buf, len, zero);
+  return buf;
+}
+
+static val tlo_load_read(val stream, val name)
+{
+  val byte = get_byte(stream);
+  val buf;
+  struct tlo_in ti;
+
+  if (byte != num_fast(TLO_MAGIC[0])) {
+    if (byte)
+      unget_byte(byte, stream);
+    return nil;
+  }
+
+  buf = make_buf(num_fast(4096), zero, nil);
+  buf_put_u8(buf, zero, byte);
+  buf = tlo_slurp(stream, buf, one);
+
+  ti.data = buf_get(buf, lit("load"));
+  ti.size = c_num(length_buf(buf));
+  ti.swap = 0;
+  ti.name = name;
+
+  tlo_load_unit(&ti);
+  gc_hint(buf);
+
+  return t;
+}
+
+val tlo_load(val stream)
+{
+  return tlo_load_read(stream, stream_get_prop(stream, name_k));
+}
+
+void tlo_init(void)
+{
+  reg_fun(intern(lit("tlo-write"), system_package), func_n2(tlo_write));
+}
@@ -149,6 +149,10 @@ static void help(void)
 "--compat=N             Synonym for -C N\n"
 "--gc-delta=N           Invoke garbage collection when malloc activity\n"
 "                       increments by N megabytes since last collection.\n"
+"--gc-threads=N         Use N threads for marking during full garbage\n"
+"                       collections of large heaps.\n"
+"--gc-pause=N           Collect garbage incrementally, in steps of\n"
+"                       about N microseconds.\n"
 "--args...              Allows multiple arguments to be encoded as a single\n"
 "                       argument. This is useful in hash-bang scripting.\n"
 "                       Peculiar syntax. See manual.\n"
@@ -163,6 +167,8 @@ static void help(void)
 "--debug-expansion      Allow debugger to step through macro-expansion of query.\n"
 "--yydebug              Debug Yacc parser, if compiled with YYDEBUG support.\n"
 "--gc-debug             Enable a garbage collector stress test (slow).\n"
+"--gc-log               Write a line to standard error for every garbage\n"
+"                       collection.\n"
 "--vg-debug             Enable Valgrind integration, if compiled in.\n"
 "--dv-regex             Handle all regexes using derivative-based back-end.\n"
 "\n"
@@ -439,6 +445,34 @@ static int gc_delta(val optval)
   return 1;
 }
 
+static int gc_threads(val optval)
+{
+  cnum n = c_num(optval);
+
+  if (n < 1) {
+    format(std_error, lit("~a: garbage collection thread count ~a "
+                          "must be positive\n"), prog_string, optval, nao);
+    return 0;
+  }
+
+  opt_gc_threads = n;
+  return 1;
+}
+
+static int gc_pause(val optval)
+{
+  cnum n = c_num(optval);
+
+  if (n < 0) {
+    format(std_error, lit("~a: garbage collection pause ~a "
+                          "must not be negative\n"), prog_string, optval, nao);
+    return 0;
+  }
+
+  opt_gc_pause = n;
+  return 1;
+}
+
 static void free_all(void)
 {
   static int called;
@@ -493,6 +527,8 @@ int txr_main(int argc, char **argv)
   val self_path_s = intern(lit("self-path"), user_package);
   val compat_var = lit("TXR_COMPAT");
   val compat_val = getenv_wrap(compat_var);
+  val gc_threads_var = lit("TXR_GC_THREADS");
+  val gc_threads_val = getenv_wrap(gc_threads_var);
   val orig_args = nil, ref_arg_list = nil;
   list_collect_decl(arg_list, arg_tail);
   list_collect_decl(eff_arg_list, eff_arg_tail);
@@ -516,6 +552,21 @@ int txr_main(int argc, char **argv)
     }
   }
 
+  if (gc_threads_val && length(gc_threads_val) != zero) {
+    val value = int_str(gc_threads_val, nil);
+    if (!value || !fixnump(value)) {
+      format(std_error,
+             lit("~a: environment variable ~a=~a must be decimal integer\n"),
+             prog_string, gc_threads_var, gc_threads_val, nao);
+      return EXIT_FAILURE;
+    }
+    if (!gc_threads(value)) {
+      format(std_error, lit("~a: caused by environment variable ~a=~a\n"),
+             prog_string, gc_threads_var, gc_threads_val, nao);
+      return EXIT_FAILURE;
+    }
+  }
+
   while (*argv)
     arg_tail = list_collect(arg_tail, string_utf8(*argv++));
 
@@ -633,6 +684,18 @@ int txr_main(int argc, char **argv)
         continue;
       }
 
+      if (equal(opt, lit("gc-threads"))) {
+        if (!do_fixnum_opt(gc_threads, opt, org))
+          return EXIT_FAILURE;
+        continue;
+      }
+
+      if (equal(opt, lit("gc-pause"))) {
+        if (!do_fixnum_opt(gc_pause, opt, org))
+          return EXIT_FAILURE;
+        continue;
+      }
+
       if (equal(opt, lit("compat"))) {
         if (!do_fixnum_opt(compat, opt, org))
           return EXIT_FAILURE;
@@ -670,6 +733,9 @@ int txr_main(int argc, char **argv)
         drop_privilege();
         opt_gc_debug = 1;
         continue;
+      } else if (equal(opt, lit("gc-log"))) {
+        opt_gc_log = 1;
+        continue;
       } else if (equal(opt, lit("vg-debug"))) {
         drop_privilege();
 #if HAVE_VALGRIND
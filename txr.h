@@ -40,6 +40,9 @@ extern int opt_debugger;
 extern int opt_dbg_autoload;
 extern int opt_dbg_expansion;
 extern alloc_bytes_t opt_gc_delta;
+extern int opt_gc_threads;
+extern cnum opt_gc_pause;
+extern int opt_gc_log;
 extern const wchli_t *version;
 extern wchar_t *progname;
 extern val stdlib_path;
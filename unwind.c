@@ -314,6 +314,25 @@ uw_frame_t *uw_current_exit_point(void)
   return uw_exit_point;
 }
 
+val uw_current_block_name(uw_frame_t *bottom)
+{
+  uw_frame_t *ex;
+
+  for (ex = uw_stack; ex != bottom; ex = ex->uw.up) {
+    switch (ex->uw.type) {
+    case UW_BLOCK:
+    case UW_CAPTURED_BLOCK:
+      if (ex->bl.tag)
+        return ex->bl.tag;
+      break;
+    default:
+      break;
+    }
+  }
+
+  return nil;
+}
+
 val uw_get_frames(void)
 {
   uw_frame_t *ex;
@@ -907,7 +926,7 @@ static val revive_cont(val dc, val arg)
       word = *wordptr;
 
       if (word >= orig_start - UW_CONT_FRAME_BEFORE &&
-          word <= orig_end && is_ptr(coerce(val, word)))
+          word <= orig_end && tag(coerce(val, word)) == TAG_PTR)
       {
         *wordptr = word + delta;
       }
@@ -154,6 +154,7 @@ void uw_pop_block(uw_frame_t *, val *pret);
 void uw_pop_until(uw_frame_t *);
 uw_frame_t *uw_current_frame(void);
 uw_frame_t *uw_current_exit_point(void);
+val uw_current_block_name(uw_frame_t *bottom);
 val uw_get_frames(void);
 val uw_find_frame(val extype, val frtype);
 val uw_find_frames(val extype, val frtype);
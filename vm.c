@@ -59,6 +59,11 @@ struct vm_desc_links {
   struct vm_desc *next, *prev;
 };
 
+struct vm_area {
+  int off;
+  int size;
+};
+
 struct vm_desc {
   struct vm_desc_links lnk;
   val self;
@@ -72,6 +77,7 @@ struct vm_desc {
   vm_word_t *code;
   val *data;
   struct vm_stent *stab;
+  struct vm_area *area;
 };
 
 struct vm_stent {
@@ -84,6 +90,8 @@ struct vm_env {
   val vec;
 };
 
+#define VM_TAIL_NARGS 8
+
 struct vm {
   struct vm_desc *vd;
   int nlvl;
@@ -91,11 +99,17 @@ struct vm {
   unsigned ip;
   vm_word_t *code;
   struct vm_env *dspl;
+  val tfun;
+  val targ[VM_TAIL_NARGS];
+  val tblocks;
+  val fun;
+  uw_frame_t *uw;
 };
 
 struct vm_closure {
   struct vm_desc *vd;
   int frsz;
+  int capturable;
   int nlvl;
   unsigned ip;
   struct vm_env dspl[1];
@@ -103,6 +117,8 @@ struct vm_closure {
 
 val vm_desc_s, vm_closure_s;
 
+struct vm *vm_top;
+
 static_forward(struct cobj_ops vm_desc_ops);
 
 static_forward(struct cobj_ops vm_closure_ops);
@@ -116,6 +132,9 @@ static struct vm_desc *vm_desc_struct(val obj)
   return coerce(struct vm_desc *, cobj_handle(obj, vm_desc_s));
 }
 
+static int vm_size_areas(struct vm_area *area, int nlvl,
+                         vm_word_t *code, cnum ncode);
+
 val vm_make_desc(val nlevels, val nregs, val bytecode,
                  val datavec, val symvec)
 {
@@ -136,10 +155,12 @@ val vm_make_desc(val nlevels, val nregs, val bytecode,
     cnum stsz = c_num(length_vec(symvec));
     loc data_loc = if3(dvl != zero, vecref_l(datavec, zero), nulloc);
     struct vm_desc *vd = coerce(struct vm_desc *, chk_malloc(sizeof *vd));
-    struct vm_desc *vtail = vmd_list.prev, *vnull = vtail->lnk.next;
+    struct vm_desc *vtail, *vnull;
     struct vm_stent *stab = if3(stsz != 0,
                                 coerce(struct vm_stent *,
                                        chk_calloc(stsz, sizeof *stab)), 0);
+    struct vm_area *area = coerce(struct vm_area *,
+                                  chk_calloc(nlvl, sizeof *area));
     val desc;
 
     vd->nlvl = nlvl;
@@ -153,7 +174,11 @@ val vm_make_desc(val nlevels, val nregs, val bytecode,
     vd->datavec = nil;
     vd->symvec = nil;
 
-    vd->frsz = nlvl * 2 + nreg;
+    vd->area = area;
+
+    vd->frsz = nlvl * 2 + nreg +
+               vm_size_areas(area, nlvl, vd->code,
+                             c_num(length_buf(bytecode)) / sizeof (vm_word_t));
 
     vd->self = nil;
 
@@ -164,6 +189,11 @@ val vm_make_desc(val nlevels, val nregs, val bytecode,
     vd->symvec = symvec;
     vd->self = desc;
 
+    /* The list is examined only now, since the allocation of desc
+       may have destroyed the descriptor at its tail. */
+    vtail = vmd_list.prev;
+    vnull = vtail->lnk.next;
+
     vd->lnk.prev = vtail;
     vd->lnk.next = vnull;
     vnull->lnk.prev = vd;
@@ -211,6 +241,7 @@ static void vm_desc_destroy(val obj)
   vn->lnk.prev = vp;
   vd->lnk.prev = vd->lnk.next = 0;
   free(vd->stab);
+  free(vd->area);
   free(vd);
 }
 
@@ -232,7 +263,7 @@ static struct vm_closure *vm_closure_struct(val obj)
   return coerce(struct vm_closure *, cobj_handle(obj, vm_closure_s));
 }
 
-static val vm_make_closure(struct vm *vm, int frsz)
+static val vm_make_closure(struct vm *vm, int frsz, int capturable)
 {
   size_t dspl_sz = vm->nlvl * sizeof (struct vm_env);
   struct vm_closure *vc = coerce(struct vm_closure *,
@@ -242,6 +273,7 @@ static val vm_make_closure(struct vm *vm, int frsz)
   int i;
 
   vc->frsz = frsz;
+  vc->capturable = capturable;
   vc->ip = vm->ip;
   vc->nlvl = vm->lev + 1;
   vc->vd = vm->vd;
@@ -308,12 +340,19 @@ static void vm_reset(struct vm *vm, struct vm_desc *vd,
   vm->ip = start_ip;
   vm->code = vd->code;
   vm->dspl = dspl;
+  vm->tfun = nil;
+  vm->tblocks = nil;
+  vm->fun = nil;
+  vm->uw = 0;
 }
 
-#define vm_insn_opcode(insn) convert(vm_op_t, ((insn) >> 26))
+#define VM_OP_BITS 6
+#define VM_OP_SHIFT (32 - VM_OP_BITS)
+
+#define vm_insn_opcode(insn) convert(vm_op_t, ((insn) >> VM_OP_SHIFT))
 #define vm_insn_operand(insn) ((insn) & 0xFFFFU)
 #define vm_insn_extra(insn) (((insn) >> 16) & 0x3FF)
-#define vm_insn_bigop(insn) (((insn) & 0x3FFFFFFU))
+#define vm_insn_bigop(insn) ((insn) & ((1U << VM_OP_SHIFT) - 1))
 #define vm_arg_operand_lo(arg) ((arg) & 0xFFFFU)
 #define vm_arg_operand_hi(arg) ((arg) >> 16)
 #define VM_LEV_BITS 10
@@ -324,6 +363,7 @@ static void vm_reset(struct vm *vm, struct vm_desc *vd,
 #define vm_idx(arg) ((arg) & VM_LEV_MASK)
 #define vm_sm_lev(arg) ((arg) >> VM_SM_LEV_BITS)
 #define vm_sm_idx(arg) ((arg) & VM_SM_LEV_MASK)
+#define VM_INL_NARGS 8
 
 static val vm_execute(struct vm *vm);
 
@@ -375,20 +415,90 @@ INLINE void vm_sm_set(struct vm_env *dspl, unsigned ref, val newval)
     mut(env->vec);
 }
 
+/*
+ * Frames are properly nested, so a function activation has at most one
+ * frame at each level. Their variables live in the activation's own frame,
+ * after the display, in an area for each level sized for the largest frame
+ * at that level, found by scanning the code. An area has an extra element
+ * in front, which saves the dynamic environment during a DFRAME, and holds
+ * t otherwise; t is never a dynamic environment.
+ */
+static int vm_size_areas(struct vm_area *area, int nlvl,
+                         vm_word_t *code, cnum ncode)
+{
+  cnum ip = 0;
+  int i, off = 0;
+
+  for (i = 0; i < nlvl; i++)
+    area[i].size = -1;
+
+  while (ip < ncode) {
+    vm_word_t insn = code[ip++];
+    int extra = vm_insn_extra(insn);
+
+    switch (vm_insn_opcode(insn)) {
+    case FRAME: case SFRAME: case DFRAME:
+      if (extra < nlvl)
+        area[extra].size = max(area[extra].size,
+                               convert(int, vm_insn_operand(insn)));
+      break;
+    case CALL: case APPLY: case GCALL: case GAPPLY: case TCALL: case TGCALL:
+      ip += 1 + extra / 2;
+      break;
+    case MOVRR: case MOVRBI: case IF: case IFQ: case IFQL: case BLOCK:
+    case RETRR: case HANDLE: case ADD: case SUB: case LT: case GT:
+    case LE: case GE: case NUMEQ:
+      ip++;
+      break;
+    case CATCH:
+      ip += 2;
+      break;
+    case SWTCH:
+      ip += (extra + 1) / 2;
+      break;
+    case CLOSE: case SCLOSE:
+      if (ip + 1 < ncode) {
+        int variadic = (vm_arg_operand_hi(code[ip]) >> VM_LEV_BITS) & 1;
+        int fixparam = vm_arg_operand_lo(code[ip + 1]);
+        ip += 2 + (fixparam + variadic + 1) / 2;
+      }
+      break;
+    default:
+      break;
+    }
+  }
+
+  for (i = 0; i < nlvl; i++) {
+    if (area[i].size >= 0) {
+      area[i].off = off;
+      off += area[i].size + 1;
+    }
+  }
+
+  return off;
+}
+
+INLINE val *vm_area(struct vm *vm, int lev)
+{
+  return coerce(val *, vm->dspl + vm->nlvl) + vm->vd->area[lev].off;
+}
 
 static void vm_do_frame(struct vm *vm, vm_word_t insn, int capturable)
 {
   int lev = vm_insn_extra(insn);
   int size = vm_insn_operand(insn);
+  val *area;
 
-  if (lev != vm->lev + 1)
+  if (lev != vm->lev + 1 || lev >= vm->nlvl || size > vm->vd->area[lev].size)
     uw_throwf(error_s, lit("frame level mismatch"), nao);
 
+  area = vm_area(vm, lev);
+  area[0] = t;
+  memset(area + 1, 0, size * sizeof *area);
+
   vm->lev = lev;
-  vm->dspl[lev].mem = coerce(val *, zalloca(size * sizeof (val *)));
+  vm->dspl[lev].mem = area + 1;
   vm->dspl[lev].vec = (capturable ? num_fast(size) : 0);
-  vm_execute(vm);
-  vm->lev = lev - 1;
 }
 
 static val vm_prof_callback(mem_t *ctx)
@@ -416,10 +526,23 @@ NOINLINE static void vm_sframe(struct vm *vm, vm_word_t insn)
 
 NOINLINE static void vm_dframe(struct vm *vm, vm_word_t insn)
 {
-  val saved_dyn_env = dyn_env;
+  vm_do_frame(vm, insn, 1);
+  vm_area(vm, vm->lev)[0] = dyn_env;
   dyn_env = make_env(nil, nil, dyn_env);
-  vm_frame(vm, insn);
-  dyn_env = saved_dyn_env;
+}
+
+/*
+ * END terminates the innermost frame if one was entered in the current
+ * activation of vm_execute; otherwise it returns from that activation.
+ */
+NOINLINE static void vm_unframe(struct vm *vm)
+{
+  val saved_dyn_env = vm_area(vm, vm->lev)[0];
+
+  if (saved_dyn_env != t)
+    dyn_env = saved_dyn_env;
+
+  vm->lev--;
 }
 
 NOINLINE static val vm_end(struct vm *vm, vm_word_t insn)
@@ -433,6 +556,192 @@ NOINLINE static val vm_fin(struct vm *vm, vm_word_t insn)
   return vm_get(vm->dspl, vm_insn_operand(insn));
 }
 
+/*
+ * Set up vm to run the closure vc, using frame for the registers and
+ * cframe, if vc->frsz is nonzero, for the closure's parameters. Both are
+ * allocated by the caller, since they live in its stack frame. Like a
+ * frame made by SFRAME, the parameter frame of a closure made by SCLOSE
+ * is never moved to the heap, since no closure refers to it.
+ */
+static void vm_closure_enter(struct vm *vm, val fun, struct vm_desc *vd,
+                             struct vm_closure *vc, val *frame, val *cframe)
+{
+  struct vm_env *dspl = coerce(struct vm_env *, frame + vd->nreg);
+
+  vm_reset(vm, vd, dspl, vc->nlvl - 1, vc->ip);
+
+  vm->fun = fun;
+  vm->uw = uw_current_frame();
+
+  frame[0] = nil;
+
+  dspl[0].mem = frame;
+  dspl[0].vec = nil;
+
+  dspl[1].mem = vd->data;
+  dspl[1].vec = vd->datavec;
+
+  memcpy(dspl + 2, vc->dspl + 2, (vc->nlvl - 2) * sizeof *dspl);
+
+  if (vc->frsz != 0) {
+    vm->lev++;
+    dspl[vm->lev].mem = cframe;
+    dspl[vm->lev].vec = (vc->capturable ? num_fast(vc->frsz) : 0);
+  }
+}
+
+static val vm_run_block(struct vm *vm, val *frame, int frsz,
+                        val *cframe, int cfrsz);
+
+/*
+ * Run vm, which has been entered at a function's entry point using
+ * frame and cframe, of frsz and cfrsz elements. If the function ends in a
+ * tail call, the callee is entered in its place, in the same frames if they
+ * are large enough, and so on until a function returns a value.
+ *
+ * The blocks which were terminated by tail calls are listed in
+ * vm->tblocks, and tblocks is the part of that list for which blocks have
+ * already been established around this loop.
+ */
+static val vm_run(struct vm *vm, val *frame, int frsz,
+                  val *cframe, int cfrsz, val tblocks)
+{
+  val fun = nil;
+
+  for (;;) {
+    struct vm_desc *vd;
+    struct vm_closure *vc;
+    vm_word_t parw = 0;
+    int i, nargs;
+
+    gc_hint(fun);
+
+    if (!vm->tfun) {
+      val result = vm_execute(vm);
+
+      if (!vm->tfun)
+        return result;
+    }
+
+    if (vm->tblocks != tblocks)
+      return vm_run_block(vm, frame, frsz, cframe, cfrsz);
+
+    fun = vm->tfun;
+    vd = coerce(struct vm_desc *, fun->f.f.vm_desc->co.handle);
+    vc = coerce(struct vm_closure *, fun->f.env->co.handle);
+    nargs = fun->f.fixparam;
+
+    if (vd->frsz > frsz) {
+      frsz = max(vd->frsz, 2 * frsz);
+      frame = coerce(val *, alloca(sizeof *frame * frsz));
+    }
+
+    if (vc->frsz > cfrsz) {
+      cfrsz = max(vc->frsz, 2 * cfrsz);
+      cframe = coerce(val *, alloca(sizeof *cframe * cfrsz));
+    }
+
+    if (vc->frsz != 0)
+      memset(cframe, 0, sizeof *cframe * vc->frsz);
+
+    vm_closure_enter(vm, fun, vd, vc, frame, cframe);
+    vm->tblocks = tblocks;
+
+    for (i = 0; i < nargs; i++) {
+      unsigned dst;
+
+      if (i % 2 == 0) {
+        parw = vm->code[vm->ip++];
+        dst = vm_arg_operand_lo(parw);
+      } else {
+        dst = vm_arg_operand_hi(parw);
+      }
+
+      vm_set(vm->dspl, dst, vm->targ[i]);
+    }
+  }
+}
+
+/*
+ * A tail call terminated the implicit block of a function whose name has
+ * not been seen before in this chain of tail calls. That block is
+ * established again here, around the rest of the chain, so that the
+ * callees can still return from it. Every function in the chain returns
+ * the value of its tail call, so returning from any of these blocks
+ * returns from the whole chain. Only one block is made for each name,
+ * which keeps the stack depth bounded by the number of distinct functions
+ * involved.
+ */
+NOINLINE static val vm_run_block(struct vm *vm, val *frame, int frsz,
+                                 val *cframe, int cfrsz)
+{
+  val tblocks = vm->tblocks;
+
+  uw_block_begin (car(tblocks), result);
+  uw_blk.bl.cont_bottom = coerce(mem_t *, vm + 1);
+  result = vm_run(vm, frame, frsz, cframe, cfrsz, tblocks);
+  uw_block_end;
+
+  return result;
+}
+
+/*
+ * A call from compiled code to a VM function which takes exactly the
+ * number of arguments given needs no argument vector: the arguments are
+ * moved from the caller's registers into the callee's parameters, in the
+ * order given by the parameter words at the callee's entry point.
+ */
+INLINE int vm_direct_p(val fun, unsigned nargs)
+{
+  return (type(fun) == FUN && fun->f.functype == FVM &&
+          !fun->f.variadic && convert(unsigned, fun->f.fixparam) == nargs);
+}
+
+NOINLINE static val vm_direct_call(struct vm *vm, val fun,
+                                   unsigned nargs, vm_word_t argw)
+{
+  struct vm_desc *vd = coerce(struct vm_desc *, fun->f.f.vm_desc->co.handle);
+  struct vm_closure *vc = coerce(struct vm_closure *, fun->f.env->co.handle);
+  struct vm cvm, *up;
+  val *frame = coerce(val *, alloca(sizeof *frame * vd->frsz));
+  val *cframe = if3(vc->frsz != 0,
+                    coerce(val *, zalloca(vc->frsz * sizeof (val *))), 0);
+  vm_word_t parw = 0;
+  unsigned i;
+  val result;
+
+  vm_closure_enter(&cvm, fun, vd, vc, frame, cframe);
+
+  for (i = 0; i < nargs; i++) {
+    unsigned src, dst;
+
+    if (i == 0) {
+      src = vm_arg_operand_hi(argw);
+    } else if (i % 2) {
+      argw = vm->code[vm->ip++];
+      src = vm_arg_operand_lo(argw);
+    } else {
+      src = vm_arg_operand_hi(argw);
+    }
+
+    if (i % 2 == 0) {
+      parw = cvm.code[cvm.ip++];
+      dst = vm_arg_operand_lo(parw);
+    } else {
+      dst = vm_arg_operand_hi(parw);
+    }
+
+    vm_set(cvm.dspl, dst, vm_getz(vm->dspl, src));
+  }
+
+  up = vm_top;
+  vm_top = &cvm;
+  result = vm_run(&cvm, frame, vd->frsz, cframe, vc->frsz, nil);
+  vm_top = up;
+  gc_hint(fun);
+  return result;
+}
+
 NOINLINE static void vm_call(struct vm *vm, vm_word_t insn)
 {
   unsigned nargs = vm_insn_extra(insn);
@@ -440,25 +749,31 @@ NOINLINE static void vm_call(struct vm *vm, vm_word_t insn)
   vm_word_t argw = vm->code[vm->ip++];
   unsigned fun = vm_arg_operand_lo(argw);
   val result;
-  args_decl (args, max(nargs, ARGS_MIN));
 
-  if (nargs--) {
-    args_add(args, vm_get(vm->dspl, vm_arg_operand_hi(argw)));
+  if (vm_direct_p(vm_get(vm->dspl, fun), nargs)) {
+    result = vm_direct_call(vm, vm_getz(vm->dspl, fun), nargs, argw);
+  } else {
+    args_decl (args, max(nargs, ARGS_MIN));
 
-    while (nargs >= 2) {
-      nargs -= 2;
-      argw = vm->code[vm->ip++];
-      args_add(args, vm_getz(vm->dspl, vm_arg_operand_lo(argw)));
-      args_add(args, vm_getz(vm->dspl, vm_arg_operand_hi(argw)));
-    }
+    if (nargs--) {
+      args_add(args, vm_get(vm->dspl, vm_arg_operand_hi(argw)));
 
-    if (nargs) {
-      argw = vm->code[vm->ip++];
-      args_add(args, vm_getz(vm->dspl, vm_arg_operand_lo(argw)));
+      while (nargs >= 2) {
+        nargs -= 2;
+        argw = vm->code[vm->ip++];
+        args_add(args, vm_getz(vm->dspl, vm_arg_operand_lo(argw)));
+        args_add(args, vm_getz(vm->dspl, vm_arg_operand_hi(argw)));
+      }
+
+      if (nargs) {
+        argw = vm->code[vm->ip++];
+        args_add(args, vm_getz(vm->dspl, vm_arg_operand_lo(argw)));
+      }
     }
+
+    result = generic_funcall(vm_getz(vm->dspl, fun), args);
   }
 
-  result = generic_funcall(vm_getz(vm->dspl, fun), args);
   vm_set(vm->dspl, dest, result);
 }
 
@@ -508,15 +823,9 @@ static loc vm_stab(struct vm *vm, unsigned fun)
   return (fe->fbloc = cdr_l(fe->fb));
 }
 
-NOINLINE static void vm_gcall(struct vm *vm, vm_word_t insn)
+INLINE void vm_gcall_args(struct vm *vm, struct args *args,
+                          unsigned nargs, vm_word_t argw)
 {
-  unsigned nargs = vm_insn_extra(insn);
-  unsigned dest = vm_insn_operand(insn);
-  vm_word_t argw = vm->code[vm->ip++];
-  unsigned fun = vm_arg_operand_lo(argw);
-  val result;
-  args_decl (args, max(nargs, ARGS_MIN));
-
   if (nargs--) {
     args_add(args, vm_getz(vm->dspl, vm_arg_operand_hi(argw)));
 
@@ -532,11 +841,58 @@ NOINLINE static void vm_gcall(struct vm *vm, vm_word_t insn)
       args_add(args, vm_getz(vm->dspl, vm_arg_operand_lo(argw)));
     }
   }
+}
+
+NOINLINE static void vm_gcall_big(struct vm *vm, vm_word_t insn)
+{
+  unsigned nargs = vm_insn_extra(insn);
+  unsigned dest = vm_insn_operand(insn);
+  vm_word_t argw = vm->code[vm->ip++];
+  unsigned fun = vm_arg_operand_lo(argw);
+  val f = deref(vm_stab(vm, fun));
+  val result;
+
+  if (vm_direct_p(f, nargs)) {
+    result = vm_direct_call(vm, f, nargs, argw);
+  } else {
+    args_decl (args, max(nargs, ARGS_MIN));
+    vm_gcall_args(vm, args, nargs, argw);
+    result = generic_funcall(f, args);
+  }
 
-  result = generic_funcall(deref(vm_stab(vm, fun)), args);
   vm_set(vm->dspl, dest, result);
 }
 
+/*
+ * Calls with few arguments are the common case. They are handled by this
+ * inline version, whose argument vector has a fixed size, so that it can
+ * live in the frame of vm_execute rather than being alloca'd on each call.
+ */
+INLINE void vm_gcall(struct vm *vm, vm_word_t insn)
+{
+  unsigned nargs = vm_insn_extra(insn);
+
+  if (nargs > VM_INL_NARGS) {
+    vm_gcall_big(vm, insn);
+  } else {
+    unsigned dest = vm_insn_operand(insn);
+    vm_word_t argw = vm->code[vm->ip++];
+    unsigned fun = vm_arg_operand_lo(argw);
+    val f = deref(vm_stab(vm, fun));
+    val result;
+
+    if (vm_direct_p(f, nargs)) {
+      result = vm_direct_call(vm, f, nargs, argw);
+    } else {
+      args_decl_constsize (args, VM_INL_NARGS);
+      vm_gcall_args(vm, args, nargs, argw);
+      result = generic_funcall(f, args);
+    }
+
+    vm_set(vm->dspl, dest, result);
+  }
+}
+
 NOINLINE static void vm_gapply(struct vm *vm, vm_word_t insn)
 {
   unsigned nargs = vm_insn_extra(insn);
@@ -566,6 +922,60 @@ NOINLINE static void vm_gapply(struct vm *vm, vm_word_t insn)
   vm_set(vm->dspl, dest, result);
 }
 
+/*
+ * A call in tail position to a function which can be entered directly
+ * does not take place here. The callee and its arguments are left in the
+ * vm, and the function carries on to its end: the instructions which
+ * follow a tail call only pass its result outward, terminating any frames
+ * and blocks. Then vm_run makes the call in place of the finished function.
+ * Other tail calls are ordinary calls.
+ */
+static void vm_tail(struct vm *vm, val fun, unsigned nargs)
+{
+  vm_word_t argw = vm->code[vm->ip++];
+  unsigned i;
+
+  for (i = 0; i < nargs; i++) {
+    unsigned src;
+
+    if (i == 0) {
+      src = vm_arg_operand_hi(argw);
+    } else if (i % 2) {
+      argw = vm->code[vm->ip++];
+      src = vm_arg_operand_lo(argw);
+    } else {
+      src = vm_arg_operand_hi(argw);
+    }
+
+    vm->targ[i] = vm_getz(vm->dspl, src);
+  }
+
+  vm->tfun = fun;
+}
+
+NOINLINE static void vm_tcall(struct vm *vm, vm_word_t insn)
+{
+  unsigned nargs = vm_insn_extra(insn);
+  unsigned fun = vm_arg_operand_lo(vm->code[vm->ip]);
+
+  if (nargs <= VM_TAIL_NARGS && vm_direct_p(vm_get(vm->dspl, fun), nargs))
+    vm_tail(vm, vm_getz(vm->dspl, fun), nargs);
+  else
+    vm_call(vm, insn);
+}
+
+NOINLINE static void vm_tgcall(struct vm *vm, vm_word_t insn)
+{
+  unsigned nargs = vm_insn_extra(insn);
+  unsigned fun = vm_arg_operand_lo(vm->code[vm->ip]);
+  val f = deref(vm_stab(vm, fun));
+
+  if (nargs <= VM_TAIL_NARGS && vm_direct_p(f, nargs))
+    vm_tail(vm, f, nargs);
+  else
+    vm_gcall(vm, insn);
+}
+
 NOINLINE static void vm_movrs(struct vm *vm, vm_word_t insn)
 {
   val datum = vm_sm_get(vm->dspl, vm_insn_extra(insn));
@@ -578,7 +988,7 @@ NOINLINE static void vm_movsr(struct vm *vm, vm_word_t insn)
   vm_sm_set(vm->dspl, vm_insn_extra(insn), datum);
 }
 
-NOINLINE static void vm_movrr(struct vm *vm, vm_word_t insn)
+INLINE void vm_movrr(struct vm *vm, vm_word_t insn)
 {
   vm_word_t arg = vm->code[vm->ip++];
   val datum = vm_get(vm->dspl, vm_arg_operand_lo(arg));
@@ -621,12 +1031,12 @@ NOINLINE static void vm_movrbi(struct vm *vm, vm_word_t insn)
   vm_set(vm->dspl, dst, coerce(val, imm));
 }
 
-static void vm_jmp(struct vm *vm, vm_word_t insn)
+INLINE void vm_jmp(struct vm *vm, vm_word_t insn)
 {
   vm->ip = vm_insn_bigop(insn);
 }
 
-NOINLINE static void vm_if(struct vm *vm, vm_word_t insn)
+INLINE void vm_if(struct vm *vm, vm_word_t insn)
 {
   unsigned ip = vm_insn_bigop(insn);
   vm_word_t arg = vm->code[vm->ip++];
@@ -701,11 +1111,16 @@ NOINLINE static void vm_block(struct vm *vm, vm_word_t insn)
   unsigned blname = vm_arg_operand_lo(arg);
   int saved_lev = vm->lev;
 
-  uw_block_begin (vm_get(vm->dspl, blname), result);
+  val name = vm_get(vm->dspl, blname);
+
+  uw_block_begin (name, result);
   uw_blk.bl.cont_bottom = coerce(mem_t *, vm + 1);
   result = vm_execute(vm);
   uw_block_end;
 
+  if (vm->tfun && !memq(name, vm->tblocks))
+    vm->tblocks = cons(name, vm->tblocks);
+
   vm_set(vm->dspl, outreg, result);
   vm->ip = exitpt;
   vm->lev = saved_lev;
@@ -816,9 +1231,9 @@ static val vm_get_binding(struct vm *vm, vm_word_t insn,
   return binding;
 }
 
-NOINLINE static void vm_getsym(struct vm *vm, vm_word_t insn,
-                               val (*lookup_fn)(val env, val sym),
-                               val kind_str)
+INLINE void vm_getsym(struct vm *vm, vm_word_t insn,
+                      val (*lookup_fn)(val env, val sym),
+                      val kind_str)
 {
   val binding = vm_get_binding(vm, insn, lookup_fn, kind_str);
   unsigned dst = vm_insn_operand(insn);
@@ -866,149 +1281,317 @@ NOINLINE static void vm_close(struct vm *vm, vm_word_t insn)
   unsigned reg = vm_arg_operand_lo(arg1);
   int reqargs = vm_arg_operand_hi(arg2);
   int fixparam = vm_arg_operand_lo(arg2);
-  val closure = vm_make_closure(vm, frsz);
+  val closure = vm_make_closure(vm, frsz, vm_insn_opcode(insn) == CLOSE);
   val vf = func_vm(closure, vm->vd->self, fixparam, reqargs, variadic);
 
   vm_set(vm->dspl, reg, vf);
   vm->ip = dst;
 }
 
-NOINLINE static val vm_execute(struct vm *vm)
+#define vm_fix(obj) (coerce(cnum, obj) >> TAG_SHIFT)
+
+INLINE void vm_add(struct vm *vm, vm_word_t insn)
 {
-  for (;;) {
-    vm_word_t insn = vm->code[vm->ip++];
-    vm_op_t opcode = vm_insn_opcode(insn);
+  vm_word_t arg = vm->code[vm->ip++];
+  val a = vm_get(vm->dspl, vm_arg_operand_hi(arg));
+  val b = vm_get(vm->dspl, vm_arg_operand_lo(arg));
+  val res;
 
-    switch (opcode) {
-    case NOOP:
-      break;
-    case FRAME:
-      vm_frame(vm, insn);
-      break;
-    case SFRAME:
-      vm_sframe(vm, insn);
-      break;
-    case DFRAME:
-      vm_dframe(vm, insn);
-      break;
-    case END:
-      return vm_end(vm, insn);
-    case FIN:
-      return vm_fin(vm, insn);
-    case PROF:
-      vm_prof(vm, insn);
-      break;
-    case CALL:
-      vm_call(vm, insn);
-      break;
-    case APPLY:
-      vm_apply(vm, insn);
-      break;
-    case GCALL:
-      vm_gcall(vm, insn);
-      break;
-    case GAPPLY:
-      vm_gapply(vm, insn);
-      break;
-    case MOVRS:
-      vm_movrs(vm, insn);
-      break;
-    case MOVSR:
-      vm_movsr(vm, insn);
-      break;
-    case MOVRR:
-      vm_movrr(vm, insn);
-      break;
-    case MOVRSI:
-      vm_movrsi(vm, insn);
-      break;
-    case MOVSMI:
-      vm_movsmi(vm, insn);
-      break;
-    case MOVRBI:
-      vm_movrbi(vm, insn);
-      break;
-    case JMP:
-      vm_jmp(vm, insn);
-      break;
-    case IF:
-      vm_if(vm, insn);
-      break;
-    case IFQ:
-      vm_ifq(vm, insn);
-      break;
-    case IFQL:
-      vm_ifql(vm, insn);
-      break;
-    case SWTCH:
-      vm_swtch(vm, insn);
-      break;
-    case UWPROT:
-      vm_uwprot(vm, insn);
-      break;
-    case BLOCK:
-      vm_block(vm, insn);
-      break;
-    case RETSR:
-      vm_retsr(vm, insn);
-      break;
-    case RETRS:
-      vm_retrs(vm, insn);
-      break;
-    case RETRR:
-      vm_retrr(vm, insn);
-      break;
-    case ABSCSR:
-      vm_abscsr(vm, insn);
-      break;
-    case CATCH:
-      vm_catch(vm, insn);
-      break;
-    case HANDLE:
-      vm_handle(vm, insn);
-      break;
-    case GETV:
-      vm_getsym(vm, insn, lookup_var, lit("variable"));
-      break;
-    case GETF:
-      vm_getsym(vm, insn, lookup_fun, lit("function"));
-      break;
-    case GETL1:
-      vm_getsym(vm, insn, lookup_sym_lisp1, lit("variable/function"));
-      break;
-    case GETVB:
-      vm_getbind(vm, insn, lookup_var, lit("variable"));
-      break;
-    case GETFB:
-      vm_getbind(vm, insn, lookup_fun, lit("function"));
-      break;
-    case GETL1B:
-      vm_getbind(vm, insn, lookup_sym_lisp1, lit("variable/function"));
-      break;
-    case SETV:
-      vm_setsym(vm, insn, lookup_var, lit("variable"));
-      break;
-    case SETL1:
-      vm_setsym(vm, insn, lookup_sym_lisp1, lit("variable/function"));
-      break;
-    case BINDV:
-      vm_bindv(vm, insn);
-      break;
-    case CLOSE:
-      vm_close(vm, insn);
-      break;
-    default:
-      uw_throwf(error_s, lit("invalid opcode ~s"), num_fast(opcode), nao);
-    }
+  if (is_num(a) && is_num(b)) {
+    cnum sum = vm_fix(a) + vm_fix(b);
+    res = (sum < NUM_MIN || sum > NUM_MAX) ? bignum(sum) : num_fast(sum);
+  } else {
+    res = plus(a, b);
+  }
+
+  vm_set(vm->dspl, vm_insn_operand(insn), res);
+}
+
+INLINE void vm_sub(struct vm *vm, vm_word_t insn)
+{
+  vm_word_t arg = vm->code[vm->ip++];
+  val a = vm_get(vm->dspl, vm_arg_operand_hi(arg));
+  val b = vm_get(vm->dspl, vm_arg_operand_lo(arg));
+  val res;
+
+  if (is_num(a) && is_num(b)) {
+    cnum diff = vm_fix(a) - vm_fix(b);
+    res = (diff < NUM_MIN || diff > NUM_MAX) ? bignum(diff) : num_fast(diff);
+  } else {
+    res = minus(a, b);
   }
+
+  vm_set(vm->dspl, vm_insn_operand(insn), res);
+}
+
+/*
+ * Fixnums with the same tag compare the same way as their
+ * untagged values, so the comparisons need no shifting.
+ */
+#define VM_NUMCMP(NAME, OP, FUN)                                        \
+  INLINE void NAME(struct vm *vm, vm_word_t insn)                       \
+  {                                                                     \
+    vm_word_t arg = vm->code[vm->ip++];                                 \
+    val a = vm_get(vm->dspl, vm_arg_operand_hi(arg));                   \
+    val b = vm_get(vm->dspl, vm_arg_operand_lo(arg));                   \
+    val res;                                                            \
+                                                                        \
+    if (is_num(a) && is_num(b))                                         \
+      res = (coerce(cnum, a) OP coerce(cnum, b)) ? t : nil;             \
+    else                                                                \
+      res = FUN(a, b);                                                  \
+                                                                        \
+    vm_set(vm->dspl, vm_insn_operand(insn), res);                       \
+  }
+
+VM_NUMCMP(vm_lt, <, lt)
+VM_NUMCMP(vm_gt, >, gt)
+VM_NUMCMP(vm_le, <=, le)
+VM_NUMCMP(vm_ge, >=, ge)
+VM_NUMCMP(vm_numeq, ==, numeq)
+
+#if CONFIG_VM_THREADED
+#define vm_case(OPCODE) op_ ## OPCODE
+#define vm_next goto *dispatch[vm_insn_opcode(insn = vm->code[vm->ip++])]
+#define vm_dispatch_begin vm_next;
+#define vm_dispatch_end
+#define vm_invalid op_invalid
+#else
+#define vm_case(OPCODE) case OPCODE
+#define vm_next break
+#define vm_dispatch_begin                                                \
+  for (;;) {                                                            \
+    insn = vm->code[vm->ip++];                                          \
+    switch (vm_insn_opcode(insn)) {
+#define vm_dispatch_end } }
+#define vm_invalid default
+#endif
+
+NOINLINE static val vm_execute(struct vm *vm)
+{
+  vm_word_t insn;
+  int lev = vm->lev;
+#if CONFIG_VM_THREADED
+  static const void *const dispatch[1 << VM_OP_BITS] = {
+    [NOOP] = &&op_NOOP,
+    [FRAME] = &&op_FRAME,
+    [SFRAME] = &&op_SFRAME,
+    [DFRAME] = &&op_DFRAME,
+    [END] = &&op_END,
+    [FIN] = &&op_FIN,
+    [PROF] = &&op_PROF,
+    [CALL] = &&op_CALL,
+    [APPLY] = &&op_APPLY,
+    [GCALL] = &&op_GCALL,
+    [GAPPLY] = &&op_GAPPLY,
+    [MOVRS] = &&op_MOVRS,
+    [MOVSR] = &&op_MOVSR,
+    [MOVRR] = &&op_MOVRR,
+    [MOVRSI] = &&op_MOVRSI,
+    [MOVSMI] = &&op_MOVSMI,
+    [MOVRBI] = &&op_MOVRBI,
+    [JMP] = &&op_JMP,
+    [IF] = &&op_IF,
+    [IFQ] = &&op_IFQ,
+    [IFQL] = &&op_IFQL,
+    [SWTCH] = &&op_SWTCH,
+    [UWPROT] = &&op_UWPROT,
+    [BLOCK] = &&op_BLOCK,
+    [RETSR] = &&op_RETSR,
+    [RETRS] = &&op_RETRS,
+    [RETRR] = &&op_RETRR,
+    [ABSCSR] = &&op_ABSCSR,
+    [CATCH] = &&op_CATCH,
+    [HANDLE] = &&op_HANDLE,
+    [GETV] = &&op_GETV,
+    [GETF] = &&op_GETF,
+    [GETL1] = &&op_GETL1,
+    [GETVB] = &&op_GETVB,
+    [GETFB] = &&op_GETFB,
+    [GETL1B] = &&op_GETL1B,
+    [SETV] = &&op_SETV,
+    [SETL1] = &&op_SETL1,
+    [BINDV] = &&op_BINDV,
+    [CLOSE] = &&op_CLOSE,
+    [ADD] = &&op_ADD,
+    [SUB] = &&op_SUB,
+    [LT] = &&op_LT,
+    [GT] = &&op_GT,
+    [LE] = &&op_LE,
+    [GE] = &&op_GE,
+    [NUMEQ] = &&op_NUMEQ,
+    [TCALL] = &&op_TCALL,
+    [TGCALL] = &&op_TGCALL,
+    [SCLOSE] = &&op_SCLOSE,
+    [VM_OP_COUNT ... (1 << VM_OP_BITS) - 1] = &&op_invalid
+  };
+#endif
+
+  vm_dispatch_begin
+  vm_case (NOOP):
+    vm_next;
+  vm_case (FRAME):
+    vm_frame(vm, insn);
+    vm_next;
+  vm_case (SFRAME):
+    vm_sframe(vm, insn);
+    vm_next;
+  vm_case (DFRAME):
+    vm_dframe(vm, insn);
+    vm_next;
+  vm_case (END):
+    if (vm->lev > lev) {
+      vm_unframe(vm);
+      vm_next;
+    }
+    return vm_end(vm, insn);
+  vm_case (FIN):
+    return vm_fin(vm, insn);
+  vm_case (PROF):
+    vm_prof(vm, insn);
+    vm_next;
+  vm_case (CALL):
+    vm_call(vm, insn);
+    vm_next;
+  vm_case (APPLY):
+    vm_apply(vm, insn);
+    vm_next;
+  vm_case (GCALL):
+    vm_gcall(vm, insn);
+    vm_next;
+  vm_case (GAPPLY):
+    vm_gapply(vm, insn);
+    vm_next;
+  vm_case (MOVRS):
+    vm_movrs(vm, insn);
+    vm_next;
+  vm_case (MOVSR):
+    vm_movsr(vm, insn);
+    vm_next;
+  vm_case (MOVRR):
+    vm_movrr(vm, insn);
+    vm_next;
+  vm_case (MOVRSI):
+    vm_movrsi(vm, insn);
+    vm_next;
+  vm_case (MOVSMI):
+    vm_movsmi(vm, insn);
+    vm_next;
+  vm_case (MOVRBI):
+    vm_movrbi(vm, insn);
+    vm_next;
+  vm_case (JMP):
+    vm_jmp(vm, insn);
+    vm_next;
+  vm_case (IF):
+    vm_if(vm, insn);
+    vm_next;
+  vm_case (IFQ):
+    vm_ifq(vm, insn);
+    vm_next;
+  vm_case (IFQL):
+    vm_ifql(vm, insn);
+    vm_next;
+  vm_case (SWTCH):
+    vm_swtch(vm, insn);
+    vm_next;
+  vm_case (UWPROT):
+    vm_uwprot(vm, insn);
+    vm_next;
+  vm_case (BLOCK):
+    vm_block(vm, insn);
+    vm_next;
+  vm_case (RETSR):
+    vm_retsr(vm, insn);
+    vm_next;
+  vm_case (RETRS):
+    vm_retrs(vm, insn);
+    vm_next;
+  vm_case (RETRR):
+    vm_retrr(vm, insn);
+    vm_next;
+  vm_case (ABSCSR):
+    vm_abscsr(vm, insn);
+    vm_next;
+  vm_case (CATCH):
+    vm_catch(vm, insn);
+    vm_next;
+  vm_case (HANDLE):
+    vm_handle(vm, insn);
+    vm_next;
+  vm_case (GETV):
+    vm_getsym(vm, insn, lookup_var, lit("variable"));
+    vm_next;
+  vm_case (GETF):
+    vm_getsym(vm, insn, lookup_fun, lit("function"));
+    vm_next;
+  vm_case (GETL1):
+    vm_getsym(vm, insn, lookup_sym_lisp1, lit("variable/function"));
+    vm_next;
+  vm_case (GETVB):
+    vm_getbind(vm, insn, lookup_var, lit("variable"));
+    vm_next;
+  vm_case (GETFB):
+    vm_getbind(vm, insn, lookup_fun, lit("function"));
+    vm_next;
+  vm_case (GETL1B):
+    vm_getbind(vm, insn, lookup_sym_lisp1, lit("variable/function"));
+    vm_next;
+  vm_case (SETV):
+    vm_setsym(vm, insn, lookup_var, lit("variable"));
+    vm_next;
+  vm_case (SETL1):
+    vm_setsym(vm, insn, lookup_sym_lisp1, lit("variable/function"));
+    vm_next;
+  vm_case (BINDV):
+    vm_bindv(vm, insn);
+    vm_next;
+  vm_case (CLOSE):
+  vm_case (SCLOSE):
+    vm_close(vm, insn);
+    vm_next;
+  vm_case (ADD):
+    vm_add(vm, insn);
+    vm_next;
+  vm_case (SUB):
+    vm_sub(vm, insn);
+    vm_next;
+  vm_case (LT):
+    vm_lt(vm, insn);
+    vm_next;
+  vm_case (GT):
+    vm_gt(vm, insn);
+    vm_next;
+  vm_case (LE):
+    vm_le(vm, insn);
+    vm_next;
+  vm_case (GE):
+    vm_ge(vm, insn);
+    vm_next;
+  vm_case (NUMEQ):
+    vm_numeq(vm, insn);
+    vm_next;
+  vm_case (TCALL):
+    vm_tcall(vm, insn);
+    vm_next;
+  vm_case (TGCALL):
+    vm_tgcall(vm, insn);
+    vm_next;
+  vm_invalid:
+    uw_throwf(error_s, lit("invalid opcode ~s"),
+              num_fast(vm_insn_opcode(insn)), nao);
+  vm_dispatch_end
+
+  abort();
 }
 
 val vm_execute_toplevel(val desc)
 {
   struct vm_desc *vd = vm_desc_struct(desc);
-  struct vm vm;
+  struct vm vm, *up = vm_top;
   val *frame = coerce(val *, alloca(sizeof *frame * vd->frsz));
   struct vm_env *dspl = coerce(struct vm_env *, frame + vd->nreg);
+  val result;
 
   vm_reset(&vm, vd, dspl, 1, 0);
 
@@ -1022,7 +1605,10 @@ val vm_execute_toplevel(val desc)
   vm.dspl[1].mem = vd->data;
   vm.dspl[1].vec = vd->datavec;
 
-  return vm_execute(&vm);
+  vm_top = &vm;
+  result = vm_run(&vm, frame, vd->frsz, 0, 0, nil);
+  vm_top = up;
+  return result;
 }
 
 val vm_execute_closure(val fun, struct args *args)
@@ -1033,32 +1619,17 @@ val vm_execute_closure(val fun, struct args *args)
   int variadic = fun->f.variadic;
   struct vm_desc *vd = vm_desc_struct(desc);
   struct vm_closure *vc = coerce(struct vm_closure *, closure->co.handle);
-  struct vm vm;
+  struct vm vm, *up = vm_top;
   val *frame = coerce(val *, alloca(sizeof *frame * vd->frsz));
+  val *cframe = if3(vc->frsz != 0,
+                    coerce(val *, zalloca(vc->frsz * sizeof (val *))), 0);
   struct vm_env *dspl = coerce(struct vm_env *, frame + vd->nreg);
   val vargs = if3(variadic, args_get_rest(args, fixparam), nil);
   cnum ix = 0;
   vm_word_t argw = 0;
+  val result;
 
-  vm_reset(&vm, vd, dspl, vc->nlvl - 1, vc->ip);
-
-  vm.dspl = coerce(struct vm_env *, frame + vd->nreg);
-
-  frame[0] = nil;
-
-  vm.dspl[0].mem = frame;
-  vm.dspl[0].vec = nil;
-
-  vm.dspl[1].mem = vd->data;
-  vm.dspl[1].vec = vd->datavec;
-
-  memcpy(vm.dspl + 2, vc->dspl + 2, (vc->nlvl - 2) * sizeof *vm.dspl);
-
-  if (vc->frsz != 0) {
-    vm.lev++;
-    vm.dspl[vm.lev].mem = coerce(val *, zalloca(vc->frsz * sizeof (val *)));
-    vm.dspl[vm.lev].vec = num_fast(vc->frsz);
-  }
+  vm_closure_enter(&vm, fun, vd, vc, frame, cframe);
 
   while (fixparam >= 2) {
     fixparam -= 2;
@@ -1087,7 +1658,24 @@ val vm_execute_closure(val fun, struct args *args)
     vm_set(dspl, vreg, z(vargs));
   }
 
-  return vm_execute(&vm);
+  vm_top = &vm;
+  result = vm_run(&vm, frame, vd->frsz, cframe, vc->frsz, nil);
+  vm_top = up;
+  return result;
+}
+
+/*
+ * The function being executed by the innermost activation of the VM,
+ * and, via pframe, the innermost unwind frame which was established
+ * before that function was entered. Allocation sampling uses this to
+ * credit a compiled function which has no block of its own.
+ */
+val vm_current_fun(uw_frame_t **pframe)
+{
+  if (!vm_top || !vm_top->fun)
+    return nil;
+  *pframe = vm_top->uw;
+  return vm_top->fun;
 }
 
 static val vm_closure_desc(val closure)
@@ -1108,6 +1696,12 @@ void vm_invalidate_binding(val sym)
 
   for (; vd != vnull; vd = vd->lnk.next) {
     cnum i;
+
+    /* The descriptor of a function which is garbage, but has not yet
+       been lazily swept, may refer to objects already reclaimed. */
+    if (gc_is_lazy_garbage(vd->self))
+      continue;
+
     for (i = 0; i < vd->stsz; i++) {
       if (vecref(vd->symvec, num_fast(i)) == sym) {
         struct vm_stent *sti = &vd->stab[i];
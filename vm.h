@@ -31,5 +31,6 @@ val vm_make_desc(val nlevels, val nregs, val bytecode,
                  val datavec, val funvec);
 val vm_execute_toplevel(val desc);
 val vm_execute_closure(val fun, struct args *);
+val vm_current_fun(uw_frame_t **pframe);
 void vm_invalidate_binding(val sym);
 void vm_init(void);
@@ -66,4 +66,16 @@ typedef enum vm_op {
   SETL1 = 37,
   BINDV = 38,
   CLOSE = 39,
+  ADD = 40,
+  SUB = 41,
+  LT = 42,
+  GT = 43,
+  LE = 44,
+  GE = 45,
+  NUMEQ = 46,
+  TCALL = 47,
+  TGCALL = 48,
+  SCLOSE = 49,
 } vm_op_t;
+
+#define VM_OP_COUNT 50